@@ -17,8 +17,14 @@
 
 #pragma once
 
-#include <atomic> // std::atomic
-#include <memory> // std::align
+#include <atomic>      // std::atomic
+#include <cstdint>     // uintptr_t
+#include <cstdlib>     // std::malloc, std::free
+#include <cstring>     // std::memcmp, std::memcpy
+#include <memory>      // std::align
+#include <new>         // placement new, std::bad_alloc
+#include <type_traits> // std::conditional, std::is_scalar
+#include <utility>     // std::swap
 
 // Padding char[]s always must hold at least one char. If the size of the object
 // ends at an alignment point, we don't want to pad one extra byte however.
@@ -32,13 +38,12 @@ mod(size_t a, size_t b)
     return a - b * (a / b);
 }
 
-// Padding bytes from end of aligned object until next alignment point. char[]
-// must hold at least one byte.
-template<class T, size_t Align>
+// Padding bytes from end of an object of `Size` bytes until next alignment
+// point. char[] must hold at least one byte.
+template<size_t Size, size_t Align>
 struct padding_bytes
 {
-    static constexpr size_t free_space =
-      Align - mod(sizeof(std::atomic<T>), Align);
+    static constexpr size_t free_space = Align - mod(Size, Align);
     static constexpr size_t required = free_space > 1 ? free_space : 1;
     char padding_[required];
 };
@@ -48,69 +53,377 @@ struct empty_struct
 
 // Class holding padding bytes is necessary. Classes can inherit from this
 // to automically add padding if necessary.
-template<class T, size_t Align>
+template<size_t Size, size_t Align>
 struct padding
-  : std::conditional<mod(sizeof(std::atomic<T>), Align) != 0,
-                     padding_bytes<T, Align>,
+  : std::conditional<mod(Size, Align) != 0,
+                     padding_bytes<Size, Align>,
                      empty_struct>::type
 {};
 
 } // end namespace padding_impl
 
+// Over-aligned allocation. Before C++17, `new` ignores alignment requirements
+// exceeding that of `std::max_align_t`, so we do it by hand.
+namespace alloc_impl {
+
+// The alloc/dealloc mechanism is pretty much
+// https://www.boost.org/doc/libs/1_76_0/boost/align/detail/aligned_alloc.hpp
+inline void*
+aligned_malloc(size_t size, size_t align) noexcept
+{
+    // Make sure alignment is at least that of void*.
+    const size_t alignment = (align >= alignof(void*)) ? align : alignof(void*);
+
+    // Allocate enough space required for object and a void*.
+    size_t space = size + alignment + sizeof(void*);
+    void* p = std::malloc(space);
+    if (p == nullptr) {
+        return nullptr;
+    }
+
+    // Shift pointer to leave space for void*.
+    void* p_algn = static_cast<char*>(p) + sizeof(void*);
+    space -= sizeof(void*);
+
+    // Shift pointer further to ensure proper alignment.
+    (void)std::align(alignment, size, p_algn, space);
+
+    // Store unaligned pointer with offset sizeof(void*) before aligned
+    // location. Later we'll know where to look for the pointer telling
+    // us where to free what we malloc()'ed above.
+    *(static_cast<void**>(p_algn) - 1) = p;
+
+    return p_algn;
+}
+
+inline void
+aligned_free(void* ptr) noexcept
+{
+    if (ptr) {
+        // Read pointer to start of malloc()'ed block and free there.
+        std::free(*(static_cast<void**>(ptr) - 1));
+    }
+}
+
+// Fixed-size array of default-constructed objects, properly aligned even if
+// `alignof(T)` is larger than what `new[]` guarantees.
+template<class T>
+class aligned_array
+{
+  public:
+    aligned_array() noexcept = default;
+
+    explicit aligned_array(size_t size)
+      : data_(static_cast<T*>(aligned_malloc(size * sizeof(T), alignof(T))))
+    {
+        if (data_ == nullptr) {
+            throw std::bad_alloc();
+        }
+        try {
+            for (; size_ < size; ++size_) {
+                ::new (static_cast<void*>(data_ + size_)) T();
+            }
+        } catch (...) {
+            destroy();
+            throw;
+        }
+    }
+
+    aligned_array(aligned_array&& other) noexcept
+      : data_(other.data_)
+      , size_(other.size_)
+    {
+        other.data_ = nullptr;
+        other.size_ = 0;
+    }
+
+    aligned_array& operator=(aligned_array&& other) noexcept
+    {
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        return *this;
+    }
+
+    aligned_array(const aligned_array&) = delete;
+    aligned_array& operator=(const aligned_array&) = delete;
+
+    ~aligned_array() { destroy(); }
+
+    T& operator[](size_t i) noexcept { return data_[i]; }
+    const T& operator[](size_t i) const noexcept { return data_[i]; }
+
+    T* begin() noexcept { return data_; }
+    T* end() noexcept { return data_ + size_; }
+    const T* begin() const noexcept { return data_; }
+    const T* end() const noexcept { return data_ + size_; }
+
+    size_t size() const noexcept { return size_; }
+
+  private:
+    void destroy() noexcept
+    {
+        while (size_ > 0) {
+            data_[--size_].~T();
+        }
+        aligned_free(data_);
+        data_ = nullptr;
+    }
+
+    T* data_{ nullptr };
+    size_t size_{ 0 };
+};
+
+} // end namespace alloc_impl
+
+// Fallback for types that `std::atomic` can't handle without locks. Instead
+// of relying on libatomic's lock table (whose locks share cache lines and
+// are shared with all other users of libatomic), objects are mapped to a
+// table of spinlocks that each have a cache line of their own.
+namespace lock_impl {
+
+template<class T>
+struct is_always_lock_free
+  : std::integral_constant<bool,
+#if defined(__cpp_lib_atomic_is_always_lock_free)
+                           std::atomic<T>::is_always_lock_free
+#elif defined(__GNUC__)
+                           __atomic_always_lock_free(sizeof(T), 0)
+#else
+                           (sizeof(T) <= sizeof(void*) &&
+                            (sizeof(T) & (sizeof(T) - 1)) == 0)
+#endif
+                           >
+{};
+
+// Spinlock guarding the object at address `p`. Defined below, since the
+// locks are `aligned_atomic`s themselves.
+inline std::atomic<bool>&
+lock_for(const volatile void* p) noexcept;
+
+class lock_guard
+{
+  public:
+    explicit lock_guard(const volatile void* p) noexcept
+      : lock_(lock_for(p))
+    {
+        while (lock_.exchange(true, std::memory_order_acquire)) {
+            while (lock_.load(std::memory_order_relaxed)) {
+            }
+        }
+    }
+
+    ~lock_guard() { lock_.store(false, std::memory_order_release); }
+
+    lock_guard(const lock_guard&) = delete;
+    lock_guard& operator=(const lock_guard&) = delete;
+
+  private:
+    std::atomic<bool>& lock_;
+};
+
+// The subset of the `std::atomic<T>` interface that applies to
+// non-arithmetic types, with every operation done under a striped lock.
+template<class T>
+class locked_atomic
+{
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "T must be trivially copyable.");
+
+  public:
+    static constexpr bool is_always_lock_free = false;
+
+    locked_atomic() noexcept = default;
+
+    constexpr locked_atomic(T desired) noexcept
+      : value_(desired)
+    {}
+
+    locked_atomic(const locked_atomic&) = delete;
+    locked_atomic& operator=(const locked_atomic&) = delete;
+
+    bool is_lock_free() const noexcept { return false; }
+
+    T load(std::memory_order = std::memory_order_seq_cst) const noexcept
+    {
+        lock_guard lk(this);
+        return value_;
+    }
+
+    void store(T desired,
+               std::memory_order = std::memory_order_seq_cst) noexcept
+    {
+        lock_guard lk(this);
+        value_ = desired;
+    }
+
+    operator T() const noexcept { return load(); }
+
+    T operator=(T desired) noexcept
+    {
+        store(desired);
+        return desired;
+    }
+
+    T exchange(T desired,
+               std::memory_order = std::memory_order_seq_cst) noexcept
+    {
+        lock_guard lk(this);
+        T old = value_;
+        value_ = desired;
+        return old;
+    }
+
+    // Compares object representations, just like `std::atomic`.
+    bool compare_exchange_strong(T& expected,
+                                 T desired,
+                                 std::memory_order = std::memory_order_seq_cst,
+                                 std::memory_order = std::memory_order_seq_cst)
+      noexcept
+    {
+        lock_guard lk(this);
+        if (std::memcmp(&value_, &expected, sizeof(T)) == 0) {
+            value_ = desired;
+            return true;
+        }
+        std::memcpy(&expected, &value_, sizeof(T));
+        return false;
+    }
+
+    bool compare_exchange_weak(T& expected,
+                               T desired,
+                               std::memory_order = std::memory_order_seq_cst,
+                               std::memory_order = std::memory_order_seq_cst)
+      noexcept
+    {
+        return compare_exchange_strong(expected, desired);
+    }
+
+    // Volatile overloads, as in `std::atomic`. The value is only accessed
+    // under the lock, so it is safe to cast the qualifier away.
+    T load(std::memory_order order = std::memory_order_seq_cst) const
+      volatile noexcept
+    {
+        return self()->load(order);
+    }
+
+    void store(T desired,
+               std::memory_order order = std::memory_order_seq_cst) volatile
+      noexcept
+    {
+        self()->store(desired, order);
+    }
+
+    operator T() const volatile noexcept { return load(); }
+
+    T operator=(T desired) volatile noexcept
+    {
+        store(desired);
+        return desired;
+    }
+
+    T exchange(T desired,
+               std::memory_order order = std::memory_order_seq_cst) volatile
+      noexcept
+    {
+        return self()->exchange(desired, order);
+    }
+
+    bool compare_exchange_strong(T& expected,
+                                 T desired,
+                                 std::memory_order = std::memory_order_seq_cst,
+                                 std::memory_order = std::memory_order_seq_cst)
+      volatile noexcept
+    {
+        return self()->compare_exchange_strong(expected, desired);
+    }
+
+    bool compare_exchange_weak(T& expected,
+                               T desired,
+                               std::memory_order = std::memory_order_seq_cst,
+                               std::memory_order = std::memory_order_seq_cst)
+      volatile noexcept
+    {
+        return self()->compare_exchange_strong(expected, desired);
+    }
+
+  private:
+    locked_atomic* self() const volatile noexcept
+    {
+        return const_cast<locked_atomic*>(this);
+    }
+
+    T value_{};
+};
+
+template<class T>
+constexpr bool locked_atomic<T>::is_always_lock_free;
+
+// Base class of `aligned_atomic<T>`. Only class types use the fallback;
+// scalars keep the full interface of `std::atomic<T>` (arithmetic,
+// conversion to `std::atomic<T>&`), even if that takes a libatomic lock.
+template<class T>
+using atomic_base =
+  typename std::conditional<is_always_lock_free<T>::value ||
+                              std::is_scalar<T>::value,
+                            std::atomic<T>,
+                            locked_atomic<T>>::type;
+
+} // end namespace lock_impl
+
 // Memory-aligned atomic `std::atomic<T>`. Behaves like `std::atomic<T>`, but
 // overloads operators `new` and `delete` to align its memory location. Padding
 // bytes are added if necessary.
+//
+// If `T` is a class type for which `std::atomic<T>` is not always lock-free,
+// operations are guarded by locks from a table of cache-aligned spinlocks
+// instead; such an `aligned_atomic<T>` doesn't convert to `std::atomic<T>&`.
+// Hot code can reject any locking with
+// `static_assert(aligned_atomic<T>::is_always_lock_free)`.
 template<class T, size_t Align = 64>
 struct alignas(Align) aligned_atomic
-  : public std::atomic<T>
-  , private padding_impl::padding<T, Align>
+  : public lock_impl::atomic_base<T>
+  , private padding_impl::padding<sizeof(lock_impl::atomic_base<T>), Align>
 {
+  private:
+    using base = lock_impl::atomic_base<T>;
+
   public:
+    static constexpr bool is_always_lock_free =
+      lock_impl::is_always_lock_free<T>::value;
+
     aligned_atomic() noexcept = default;
 
     aligned_atomic(T desired) noexcept
-      : std::atomic<T>(desired)
+      : base(desired)
     {}
 
     // Assignment operators have been deleted, must redefine.
-    T operator=(T x) noexcept { return std::atomic<T>::operator=(x); }
-    T operator=(T x) volatile noexcept { return std::atomic<T>::operator=(x); }
+    T operator=(T x) noexcept { return base::operator=(x); }
+    T operator=(T x) volatile noexcept { return base::operator=(x); }
 
-    // The alloc/dealloc mechanism is pretty much
-    // https://www.boost.org/doc/libs/1_76_0/boost/align/detail/aligned_alloc.hpp
     static void* operator new(size_t count) noexcept
     {
-        // Make sure alignment is at least that of void*.
-        constexpr size_t alignment =
-          (Align >= alignof(void*)) ? Align : alignof(void*);
+        return alloc_impl::aligned_malloc(count, Align);
+    }
 
-        // Allocate enough space required for object and a void*.
-        size_t space = count + alignment + sizeof(void*);
-        void* p = std::malloc(space);
-        if (p == nullptr) {
-            return nullptr;
-        }
+    static void operator delete(void* ptr) { alloc_impl::aligned_free(ptr); }
+};
 
-        // Shift pointer to leave space for void*.
-        void* p_algn = static_cast<char*>(p) + sizeof(void*);
-        space -= sizeof(void*);
+template<class T, size_t Align>
+constexpr bool aligned_atomic<T, Align>::is_always_lock_free;
 
-        // Shift pointer further to ensure proper alignment.
-        (void)std::align(alignment, count, p_algn, space);
+namespace lock_impl {
 
-        // Store unaligned pointer with offset sizeof(void*) before aligned
-        // location. Later we'll know where to look for the pointer telling
-        // us where to free what we malloc()'ed above.
-        *(static_cast<void**>(p_algn) - 1) = p;
+constexpr size_t num_locks = 128;
 
-        return p_algn;
-    }
+inline std::atomic<bool>&
+lock_for(const volatile void* p) noexcept
+{
+    // Zero-initialized at load time; no guard variable needed.
+    static aligned_atomic<bool> locks[num_locks];
+    uintptr_t h = reinterpret_cast<uintptr_t>(p);
+    h ^= h >> 6 ^ h >> 12 ^ h >> 18;
+    return locks[h % num_locks];
+}
 
-    static void operator delete(void* ptr)
-    {
-        if (ptr) {
-            // Read pointer to start of malloc()'ed block and free there.
-            std::free(*(static_cast<void**>(ptr) - 1));
-        }
-    }
-};
+} // end namespace lock_impl
@@ -0,0 +1,126 @@
+// Copyright (c) 2021 Thomas Nagler
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "aligned_atomic.hpp"
+
+#include <utility> // std::declval
+
+// Declares an atomic field of type `T`, named by the (empty) type `Tag`.
+template<class Tag, class T>
+struct field
+{};
+
+// Declares fields that are written by the same thread(s) and may therefore
+// share a cache line.
+template<class... Fields>
+struct field_group
+{};
+
+namespace fields_impl {
+
+// Storage for one field. Fields are looked up by deducing `T` from the
+// (unique) base class `storage<Tag, T>`.
+template<class Tag, class T>
+struct storage
+{
+    static_assert(lock_impl::is_always_lock_free<T>::value,
+                  "Field types must be lock-free.");
+
+    std::atomic<T> value{};
+};
+
+template<class Tag, class T>
+std::atomic<T>&
+get(storage<Tag, T>& s) noexcept
+{
+    return s.value;
+}
+
+template<class Tag, class T>
+const std::atomic<T>&
+get(const storage<Tag, T>& s) noexcept
+{
+    return s.value;
+}
+
+// One cache line holding all fields of a group.
+template<size_t Align, class Group>
+struct line;
+
+template<size_t Align, class... Tags, class... Ts>
+struct alignas(Align) line<Align, field_group<field<Tags, Ts>...>>
+  : storage<Tags, Ts>...
+{};
+
+} // end namespace fields_impl
+
+// Struct of atomics where every `field_group` occupies a cache line of its
+// own. Fields are accessed by tag:
+//
+//   struct rx_bytes {};
+//   struct tx_bytes {};
+//   aligned_fields<field_group<field<rx_bytes, uint64_t>>,
+//                  field_group<field<tx_bytes, uint64_t>>> stats;
+//   stats.get<rx_bytes>().fetch_add(n, std::memory_order_relaxed);
+//
+// All fields start at zero. A group that doesn't fit into a single line, or a
+// tag that is used twice, is a compile-time error.
+template<size_t Align, class... Groups>
+class basic_aligned_fields : private fields_impl::line<Align, Groups>...
+{
+  public:
+    static constexpr size_t num_lines = sizeof...(Groups);
+
+    basic_aligned_fields() noexcept
+    {
+        static_assert(all_fit(sizeof(fields_impl::line<Align, Groups>)...),
+                      "A field group doesn't fit into a single line.");
+        static_assert(sizeof(basic_aligned_fields) == num_lines * Align,
+                      "Unexpected padding between lines.");
+        static_assert(alignof(basic_aligned_fields) == Align,
+                      "Unexpected alignment.");
+    }
+
+    // Field named `Tag`.
+    template<class Tag>
+    auto get() noexcept -> decltype(fields_impl::get<Tag>(
+      std::declval<basic_aligned_fields&>()))
+    {
+        return fields_impl::get<Tag>(*this);
+    }
+
+    template<class Tag>
+    auto get() const noexcept -> decltype(fields_impl::get<Tag>(
+      std::declval<const basic_aligned_fields&>()))
+    {
+        return fields_impl::get<Tag>(*this);
+    }
+
+  private:
+    static constexpr bool all_fit() { return true; }
+
+    template<class... Sizes>
+    static constexpr bool all_fit(size_t size, Sizes... sizes)
+    {
+        return size == Align && all_fit(sizes...);
+    }
+};
+
+template<class... Groups>
+using aligned_fields = basic_aligned_fields<64, Groups...>;
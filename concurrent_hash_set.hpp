@@ -0,0 +1,231 @@
+// Copyright (c) 2021 Thomas Nagler
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "aligned_atomic.hpp"
+#include "hash_mix.hpp"
+
+#include <cstdint>     // uint8_t, uint64_t
+#include <functional>  // std::hash
+#include <stdexcept>   // std::length_error
+#include <type_traits> // std::is_trivially_copyable
+
+namespace hash_set_impl {
+
+// A group's control word holds one byte per slot: `empty`, `busy` while the
+// key is being written, or `full`, the latter two with a 7-bit tag of the
+// hash in the low bits. Bytes are compared eight at a time (SWAR).
+constexpr uint64_t lsb = 0x0101010101010101ULL;
+constexpr uint64_t msb = 0x8080808080808080ULL;
+constexpr uint64_t empty = 0x00;
+constexpr uint64_t full = 0x80;
+
+// Sets the high bit of every byte in `ctrl` that equals `b` (exact, no false
+// positives), restricted to the bytes in `valid`.
+inline uint64_t
+match(uint64_t ctrl, uint64_t b, uint64_t valid) noexcept
+{
+    uint64_t x = ctrl ^ (lsb * b);
+    return ~(((x & ~msb) + ~msb) | x | ~msb) & valid;
+}
+
+// Index of the byte holding the lowest set bit.
+inline size_t
+first_byte(uint64_t bits) noexcept
+{
+#if defined(__GNUC__)
+    return static_cast<size_t>(__builtin_ctzll(bits)) / 8;
+#else
+    size_t i = 0;
+    while ((bits & 0xff) == 0) {
+        bits >>= 8;
+        ++i;
+    }
+    return i;
+#endif
+}
+
+// Slots per group: as many as fit into a line next to the control word (at
+// most one per control byte).
+template<class T, size_t Align>
+struct group_size
+{
+    static constexpr size_t fit = (Align - sizeof(uint64_t)) / sizeof(T);
+    static constexpr size_t value = fit < 8 ? fit : 8;
+};
+
+template<class T, size_t Align>
+struct group_base
+{
+    std::atomic<uint64_t> ctrl;
+    std::atomic<T> slots[group_size<T, Align>::value];
+};
+
+// Control word and slots of a group, padded to exactly one line.
+template<class T, size_t Align>
+struct alignas(Align) group
+  : group_base<T, Align>
+  , private padding_impl::padding<sizeof(group_base<T, Align>), Align>
+{
+    group() noexcept { this->ctrl.store(empty, std::memory_order_relaxed); }
+};
+
+} // end namespace hash_set_impl
+
+// Insert-only, fixed-capacity concurrent hash set. Slots are organized in
+// groups that fill exactly one `Align`-sized line: a 64-bit control word
+// followed by as many keys as fit (seven 8-byte keys per 64-byte line). A
+// probe loads a group's control word once and compares all of its tags at
+// once, so lookups usually touch a single line, and inserts into different
+// groups never write to the same line.
+//
+// `contains()` is wait-free. `insert()` is lock-free, except that it waits
+// while another thread writes a key with the same 7-bit tag into the same
+// group (a few instructions), since that key might be the same.
+template<class T, size_t Align = 64, class Hash = std::hash<T>>
+class concurrent_hash_set
+{
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "T must be trivially copyable.");
+    static_assert(lock_impl::is_always_lock_free<T>::value,
+                  "std::atomic<T> must be lock-free.");
+
+    using group = hash_set_impl::group<T, Align>;
+
+  public:
+    static constexpr size_t group_size =
+      hash_set_impl::group_size<T, Align>::value;
+    static_assert(group_size > 0, "Align is too small for T.");
+
+    // Room for at least `capacity` keys at a load factor of at most 7/8.
+    explicit concurrent_hash_set(size_t capacity)
+      : groups_(num_groups(capacity))
+      , mask_(groups_.size() - 1)
+    {
+        static_assert(sizeof(group) == Align, "Groups must fill one line.");
+    }
+
+    concurrent_hash_set(const concurrent_hash_set&) = delete;
+    concurrent_hash_set& operator=(const concurrent_hash_set&) = delete;
+
+    // Inserts `key`; returns false if it was already present. Throws
+    // `std::length_error` if all slots are taken.
+    bool insert(const T& key)
+    {
+        using namespace hash_set_impl;
+        uint64_t h = hash_impl::mix64(hash_(key));
+        uint64_t tag = tag_of(h);
+        size_t g = h & mask_;
+        for (size_t step = 0; step <= mask_; ++step) {
+            group& grp = groups_[g];
+            uint64_t ctrl = grp.ctrl.load(std::memory_order_acquire);
+            while (true) {
+                // A busy slot with our tag may be about to hold `key`.
+                while (match(ctrl, tag, valid) != 0) {
+                    ctrl = grp.ctrl.load(std::memory_order_acquire);
+                }
+                if (find_in(grp, ctrl, key, tag)) {
+                    return false;
+                }
+                uint64_t free = match(ctrl, empty, valid);
+                if (free == 0) {
+                    break; // group is full, try the next one
+                }
+                // Claim the first empty slot, then write the key.
+                size_t i = first_byte(free);
+                uint64_t claimed = ctrl | (tag << (8 * i));
+                if (!grp.ctrl.compare_exchange_weak(
+                      ctrl, claimed, std::memory_order_acquire)) {
+                    continue;
+                }
+                grp.slots[i].store(key, std::memory_order_relaxed);
+                grp.ctrl.fetch_or(full << (8 * i), std::memory_order_release);
+                return true;
+            }
+            g = (g + step + 1) & mask_; // triangular probing visits all groups
+        }
+        throw std::length_error("concurrent_hash_set: no free slot");
+    }
+
+    bool contains(const T& key) const noexcept
+    {
+        using namespace hash_set_impl;
+        uint64_t h = hash_impl::mix64(hash_(key));
+        uint64_t tag = tag_of(h);
+        size_t g = h & mask_;
+        for (size_t step = 0; step <= mask_; ++step) {
+            const group& grp = groups_[g];
+            uint64_t ctrl = grp.ctrl.load(std::memory_order_acquire);
+            if (find_in(grp, ctrl, key, tag)) {
+                return true;
+            }
+            if (match(ctrl, empty, valid) != 0) {
+                return false; // keys never move past a group with room
+            }
+            g = (g + step + 1) & mask_;
+        }
+        return false;
+    }
+
+    // Number of slots.
+    size_t capacity() const noexcept { return groups_.size() * group_size; }
+
+  private:
+    // Bytes of the control word that belong to slots.
+    static constexpr uint64_t valid =
+      group_size == 8 ? hash_set_impl::msb
+                      : hash_set_impl::msb & ((1ULL << (8 * group_size)) - 1);
+
+    static size_t num_groups(size_t capacity) noexcept
+    {
+        size_t n = 1;
+        while (n * group_size * 7 < capacity * 8) {
+            n *= 2;
+        }
+        return n;
+    }
+
+    // Tags are in [1, 127], so that a busy slot differs from an empty one.
+    static uint64_t tag_of(uint64_t h) noexcept { return 1 + (h >> 57) % 127; }
+
+    // Whether `key` is in one of the full slots of `grp` (per `ctrl`).
+    static bool find_in(const group& grp,
+                        uint64_t ctrl,
+                        const T& key,
+                        uint64_t tag) noexcept
+    {
+        using namespace hash_set_impl;
+        for (uint64_t m = match(ctrl, full | tag, valid); m != 0; m &= m - 1) {
+            if (grp.slots[first_byte(m)].load(std::memory_order_relaxed) ==
+                key) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    alloc_impl::aligned_array<group> groups_;
+    size_t mask_;
+    Hash hash_;
+};
+
+template<class T, size_t Align, class Hash>
+constexpr size_t concurrent_hash_set<T, Align, Hash>::group_size;
+
+template<class T, size_t Align, class Hash>
+constexpr uint64_t concurrent_hash_set<T, Align, Hash>::valid;
@@ -0,0 +1,265 @@
+// Copyright (c) 2021 Thomas Nagler
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "aligned_atomic.hpp"
+#include "hash_mix.hpp"
+#include "thread_registry.hpp"
+
+#include <cstdint>    // uint64_t
+#include <functional> // std::hash
+#include <limits>     // std::numeric_limits
+#include <stdexcept>  // std::invalid_argument
+
+namespace cms_impl {
+
+constexpr size_t max_depth = 16;
+
+// `depth` rows of `width` counters. Each row starts on a line boundary, so
+// rows (and rows of different tables) never share a line.
+template<size_t Align>
+class table
+{
+  public:
+    static constexpr size_t per_line = Align / sizeof(uint64_t);
+
+    table(size_t width, size_t depth)
+      : width_((width + per_line - 1) / per_line * per_line)
+      , depth_(depth)
+      , lines_(width_ / per_line * depth)
+    {}
+
+    std::atomic<uint64_t>& at(size_t row, size_t col) noexcept
+    {
+        return lines_[(row * width_ + col) / per_line]
+          .counters[(row * width_ + col) % per_line];
+    }
+
+    const std::atomic<uint64_t>& at(size_t row, size_t col) const noexcept
+    {
+        return const_cast<table*>(this)->at(row, col);
+    }
+
+    size_t width() const noexcept { return width_; }
+    size_t depth() const noexcept { return depth_; }
+
+  private:
+    struct alignas(Align) line
+    {
+        std::atomic<uint64_t> counters[per_line];
+    };
+
+    size_t width_;
+    size_t depth_;
+    alloc_impl::aligned_array<line> lines_;
+};
+
+template<size_t Align>
+constexpr size_t table<Align>::per_line;
+
+// Column of `key` in each row, by double hashing (Kirsch and Mitzenmacher).
+struct columns
+{
+    columns(uint64_t hash, size_t width, size_t depth) noexcept
+      : depth(depth)
+    {
+        uint64_t h = hash_impl::mix64(hash);
+        uint64_t step = hash_impl::mix64(h) | 1;
+        for (size_t i = 0; i < depth; ++i, h += step) {
+            col[i] = static_cast<size_t>(((h >> 32) * width) >> 32);
+        }
+    }
+
+    size_t depth;
+    size_t col[max_depth];
+};
+
+// Returns `width` if the dimensions are valid.
+inline size_t
+check_dimensions(size_t width, size_t depth)
+{
+    if (width == 0 || width > (size_t(1) << 32) || depth == 0 ||
+        depth > max_depth) {
+        throw std::invalid_argument("count_min_sketch: invalid dimensions");
+    }
+    return width;
+}
+
+} // end namespace cms_impl
+
+// Count-min sketch (Cormode and Muthukrishnan, 2005) with shared counters.
+// Updates are relaxed `fetch_add()`s on `depth` counters, rows are aligned to
+// cache lines. Estimates never undercount; with width `w` and depth `d`,
+// they overcount by at most `e / w` times the total count with probability
+// `1 - exp(-d)`.
+//
+// Conservative update needs a single writer per counter and is therefore
+// only offered by `sharded_count_min_sketch`.
+template<class Key, class Hash = std::hash<Key>, size_t Align = 64>
+class count_min_sketch
+{
+  public:
+    count_min_sketch(size_t width, size_t depth = 4)
+      : table_(cms_impl::check_dimensions(width, depth), depth)
+    {}
+
+    count_min_sketch(const count_min_sketch&) = delete;
+    count_min_sketch& operator=(const count_min_sketch&) = delete;
+
+    void add(const Key& key, uint64_t n = 1) noexcept
+    {
+        cms_impl::columns c(hash_(key), table_.width(), table_.depth());
+        for (size_t i = 0; i < c.depth; ++i) {
+            table_.at(i, c.col[i]).fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t estimate(const Key& key) const noexcept
+    {
+        return min(
+          cms_impl::columns(hash_(key), table_.width(), table_.depth()));
+    }
+
+    size_t width() const noexcept { return table_.width(); }
+    size_t depth() const noexcept { return table_.depth(); }
+
+  private:
+    uint64_t min(const cms_impl::columns& c) const noexcept
+    {
+        uint64_t m = std::numeric_limits<uint64_t>::max();
+        for (size_t i = 0; i < c.depth; ++i) {
+            uint64_t v = table_.at(i, c.col[i]).load(std::memory_order_relaxed);
+            m = v < m ? v : m;
+        }
+        return m;
+    }
+
+    cms_impl::table<Align> table_;
+    Hash hash_;
+};
+
+// Count-min sketch with one table per thread. Threads only write their own
+// table (plain loads and stores, no read-modify-write), and tables are only
+// combined by `estimate()`, which sums each counter over all tables before
+// taking the minimum over rows. Updates scale with the number of threads;
+// estimates cost `depth` loads per thread.
+template<class Key, class Hash = std::hash<Key>, size_t Align = 64>
+class sharded_count_min_sketch
+{
+  public:
+    sharded_count_min_sketch(size_t width, size_t depth = 4)
+      : width_(cms_impl::check_dimensions(width, depth))
+      , depth_(depth)
+    {}
+
+    sharded_count_min_sketch(const sharded_count_min_sketch&) = delete;
+    sharded_count_min_sketch& operator=(const sharded_count_min_sketch&) =
+      delete;
+
+    ~sharded_count_min_sketch()
+    {
+        tables_.for_each([](std::atomic<table*>& t) { delete t.load(); });
+    }
+
+    void add(const Key& key, uint64_t n = 1)
+    {
+        table& t = local();
+        cms_impl::columns c(hash_(key), t.width(), t.depth());
+        for (size_t i = 0; i < c.depth; ++i) {
+            bump(t.at(i, c.col[i]), n);
+        }
+    }
+
+    // Conservative update (Estan and Varghese): only raises the counters
+    // that are below the new estimate of the calling thread's table, which
+    // reduces overcounting considerably for skewed streams.
+    void add_conservative(const Key& key, uint64_t n = 1)
+    {
+        table& t = local();
+        cms_impl::columns c(hash_(key), t.width(), t.depth());
+        uint64_t target = std::numeric_limits<uint64_t>::max();
+        for (size_t i = 0; i < c.depth; ++i) {
+            uint64_t v = t.at(i, c.col[i]).load(std::memory_order_relaxed);
+            target = v < target ? v : target;
+        }
+        target += n;
+        for (size_t i = 0; i < c.depth; ++i) {
+            auto& counter = t.at(i, c.col[i]);
+            if (counter.load(std::memory_order_relaxed) < target) {
+                counter.store(target, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    uint64_t estimate(const Key& key) const
+    {
+        cms_impl::columns c(hash_(key), padded_width(), depth_);
+        uint64_t sums[cms_impl::max_depth] = {};
+        tables_.for_each([&](std::atomic<table*>& slot) {
+            const table* t = slot.load(std::memory_order_acquire);
+            if (t == nullptr) {
+                return;
+            }
+            for (size_t i = 0; i < c.depth; ++i) {
+                sums[i] += t->at(i, c.col[i]).load(std::memory_order_relaxed);
+            }
+        });
+        uint64_t m = sums[0];
+        for (size_t i = 1; i < c.depth; ++i) {
+            m = sums[i] < m ? sums[i] : m;
+        }
+        return m;
+    }
+
+    size_t width() const noexcept { return padded_width(); }
+    size_t depth() const noexcept { return depth_; }
+
+  private:
+    using table = cms_impl::table<Align>;
+
+    // Single writer: no read-modify-write needed.
+    static void bump(std::atomic<uint64_t>& counter, uint64_t n) noexcept
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + n,
+                      std::memory_order_relaxed);
+    }
+
+    size_t padded_width() const noexcept
+    {
+        size_t per_line = table::per_line;
+        return (width_ + per_line - 1) / per_line * per_line;
+    }
+
+    table& local()
+    {
+        std::atomic<table*>& slot = tables_.local();
+        table* t = slot.load(std::memory_order_relaxed);
+        if (t == nullptr) {
+            t = new table(width_, depth_);
+            slot.store(t, std::memory_order_release);
+        }
+        return *t;
+    }
+
+    size_t width_;
+    size_t depth_;
+    // Tables live as long as the sketch; a new thread with a recycled index
+    // continues its predecessor's table.
+    mutable thread_slots<std::atomic<table*>> tables_;
+    Hash hash_;
+};
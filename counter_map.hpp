@@ -0,0 +1,233 @@
+// Copyright (c) 2021 Thomas Nagler
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "aligned_atomic.hpp"
+
+#include <cstdint>    // uint64_t
+#include <functional> // std::hash, std::equal_to
+#include <memory>     // std::unique_ptr
+#include <mutex>      // std::mutex, std::lock_guard
+#include <new>        // std::bad_alloc
+#include <string>     // std::string
+#include <utility>    // std::move
+#include <vector>     // std::vector
+
+// Map from keys to `aligned_atomic<uint64_t>` counters that are created on
+// first use and live as long as the map. Lookups are lock-free; only the
+// first lookup of a key takes a lock to insert it. Callers are expected to
+// cache the returned `handle`, so that the hot path is a single `fetch_add()`
+// on a line of its own.
+template<class Key = std::string,
+         size_t Align = 64,
+         class Hash = std::hash<Key>,
+         class KeyEqual = std::equal_to<Key>>
+class counter_map
+{
+  public:
+    using counter_type = aligned_atomic<uint64_t, Align>;
+
+    // Stable reference to a counter; valid as long as the map.
+    class handle
+    {
+      public:
+        handle() noexcept = default;
+
+        void add(uint64_t n = 1) const noexcept
+        {
+            counter_->fetch_add(n, std::memory_order_relaxed);
+        }
+
+        uint64_t load() const noexcept
+        {
+            return counter_->load(std::memory_order_relaxed);
+        }
+
+        counter_type& operator*() const noexcept { return *counter_; }
+        counter_type* operator->() const noexcept { return counter_; }
+
+        explicit operator bool() const noexcept { return counter_ != nullptr; }
+
+      private:
+        friend class counter_map;
+
+        explicit handle(counter_type* counter) noexcept
+          : counter_(counter)
+        {}
+
+        counter_type* counter_{ nullptr };
+    };
+
+    explicit counter_map(size_t initial_capacity = 64)
+    {
+        size_t capacity = 8;
+        while (capacity < 2 * initial_capacity) {
+            capacity *= 2;
+        }
+        tables_.push_back(std::unique_ptr<table>(new table(capacity)));
+        table_.store(tables_.back().get(), std::memory_order_release);
+    }
+
+    counter_map(const counter_map&) = delete;
+    counter_map& operator=(const counter_map&) = delete;
+
+    // Counter for `key`, inserted (at zero) if it doesn't exist yet.
+    handle get(const Key& key)
+    {
+        size_t h = hash_(key);
+        node* n = find(*table_.load(std::memory_order_acquire), key, h);
+        if (n != nullptr) {
+            return handle(&n->counter);
+        }
+        return handle(&insert(key, h)->counter);
+    }
+
+    counter_type& operator[](const Key& key) { return *get(key); }
+
+    // Counter for `key`, or an empty handle if there is none. Never locks.
+    handle find(const Key& key) const
+    {
+        size_t h = hash_(key);
+        node* n = find(*table_.load(std::memory_order_acquire), key, h);
+        return handle(n ? &n->counter : nullptr);
+    }
+
+    // Number of keys.
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        return nodes_.size();
+    }
+
+    // Calls `f(key, value)` for every counter, in insertion order.
+    template<class F>
+    void for_each(F f) const
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        for (const auto& n : nodes_) {
+            f(n->key, n->counter.load(std::memory_order_relaxed));
+        }
+    }
+
+  private:
+    // The counter comes first, so that it has its line to itself; the key
+    // starts on the next one.
+    struct node
+    {
+        node(const Key& k, size_t h)
+          : key(k)
+          , hash(h)
+        {}
+
+        counter_type counter{ 0 };
+        Key key;
+        size_t hash;
+
+        static void* operator new(size_t count)
+        {
+            void* p = alloc_impl::aligned_malloc(count, alignof(node));
+            if (p == nullptr) {
+                throw std::bad_alloc();
+            }
+            return p;
+        }
+
+        static void operator delete(void* ptr)
+        {
+            alloc_impl::aligned_free(ptr);
+        }
+    };
+
+    // Open addressing with linear probing over node pointers. Slots only
+    // ever change from null to a node, so readers need no synchronization
+    // beyond acquire loads.
+    struct table
+    {
+        explicit table(size_t capacity)
+          : mask(capacity - 1)
+          , slots(new std::atomic<node*>[capacity])
+        {
+            for (size_t i = 0; i < capacity; ++i) {
+                slots[i].store(nullptr, std::memory_order_relaxed);
+            }
+        }
+
+        size_t mask;
+        std::unique_ptr<std::atomic<node*>[]> slots;
+    };
+
+    node* find(const table& t, const Key& key, size_t h) const
+    {
+        for (size_t i = h & t.mask;; i = (i + 1) & t.mask) {
+            node* n = t.slots[i].load(std::memory_order_acquire);
+            if (n == nullptr || (n->hash == h && equal_(n->key, key))) {
+                return n;
+            }
+        }
+    }
+
+    static void place(table& t, node* n) noexcept
+    {
+        size_t i = n->hash & t.mask;
+        while (t.slots[i].load(std::memory_order_relaxed) != nullptr) {
+            i = (i + 1) & t.mask;
+        }
+        t.slots[i].store(n, std::memory_order_release);
+    }
+
+    node* insert(const Key& key, size_t h)
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        table* t = table_.load(std::memory_order_relaxed);
+        node* n = find(*t, key, h);
+        if (n != nullptr) {
+            return n; // inserted concurrently
+        }
+
+        // Allocate everything first, so that a failure leaves the map as
+        // it was.
+        std::unique_ptr<node> fresh(new node(key, h));
+        std::unique_ptr<table> grown;
+        if (2 * (nodes_.size() + 1) > t->mask + 1) {
+            grown.reset(new table(2 * (t->mask + 1)));
+            tables_.reserve(tables_.size() + 1);
+        }
+        n = fresh.get();
+        nodes_.push_back(std::move(fresh));
+        if (grown) {
+            // Readers may still be probing the old table, so it is kept
+            // until the map is destroyed (at most as much memory again as
+            // the current table).
+            for (const auto& m : nodes_) {
+                place(*grown, m.get());
+            }
+            tables_.push_back(std::move(grown));
+            table_.store(tables_.back().get(), std::memory_order_release);
+        } else {
+            place(*t, n);
+        }
+        return n;
+    }
+
+    aligned_atomic<table*> table_;
+    Hash hash_;
+    KeyEqual equal_;
+    mutable std::mutex mtx_;
+    std::vector<std::unique_ptr<node>> nodes_;
+    std::vector<std::unique_ptr<table>> tables_;
+};
@@ -0,0 +1,278 @@
+// Copyright (c) 2021 Thomas Nagler
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "aligned_atomic.hpp"
+#include "thread_registry.hpp"
+
+#include <cstdint>   // uint32_t, uint64_t
+#include <stdexcept> // std::length_error
+
+namespace elimination_impl {
+
+// Exchanger slot word: state << 62 | value.
+constexpr uint64_t vacant = 0;
+constexpr uint64_t push_waiting = uint64_t(1) << 62; // | value
+constexpr uint64_t pop_waiting = uint64_t(2) << 62;
+constexpr uint64_t done = uint64_t(3) << 62; // | value (for the popper)
+constexpr uint64_t state_mask = uint64_t(3) << 62;
+
+// How long a thread waits in a slot for a partner.
+constexpr size_t patience = 128;
+
+// Per-thread view of the elimination array: the number of slots it uses,
+// adapted to the contention it sees, and a random number generator.
+struct alignas(64) backoff
+{
+    size_t range{ 1 };
+    uint64_t rng{ 0 };
+};
+
+inline uint64_t
+xorshift(uint64_t& x) noexcept
+{
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x;
+}
+
+} // end namespace elimination_impl
+
+// Lock-free LIFO free list of the indices `[0, capacity)` (Treiber stack),
+// with an elimination array (Hendler, Shavit, and Yerushalmi, 2004). When
+// the CAS on the head fails, a thread instead waits briefly in a random
+// exchanger slot, each an `aligned_atomic` on its own line: a push and a pop
+// that meet there cancel out without touching the head. Each thread spreads
+// over more slots when it finds them busy and fewer when it waits in vain,
+// so the array adapts to the level of contention.
+//
+// Every index may be in the stack at most once. The head carries a version
+// tag against ABA, so nodes need no memory reclamation.
+template<size_t Align = 64>
+class elimination_stack
+{
+  public:
+    static constexpr size_t max_capacity = (size_t(1) << 32) - 1;
+
+    // Empty stack for indices `[0, capacity)`, or holding all of them if
+    // `full` (with 0 on top). `num_slots` bounds the elimination array.
+    explicit elimination_stack(size_t capacity,
+                               bool full = false,
+                               size_t num_slots = 16)
+      : next_(check_capacity(capacity))
+      , slots_(num_slots > 0 ? num_slots : 1)
+    {
+        if (full) {
+            for (size_t i = 0; i + 1 < capacity; ++i) {
+                next_[i].store(static_cast<uint32_t>(i + 2));
+            }
+            head_.store(capacity > 0 ? 1 : 0);
+        }
+    }
+
+    elimination_stack(const elimination_stack&) = delete;
+    elimination_stack& operator=(const elimination_stack&) = delete;
+
+    void push(uint32_t index)
+    {
+        auto& b = backoff_.local();
+        while (!try_push(index) && !exchange_push(index, b)) {
+        }
+    }
+
+    // Pops an index; returns false if the stack is empty.
+    bool pop(uint32_t& index)
+    {
+        auto& b = backoff_.local();
+        while (true) {
+            switch (try_pop(index)) {
+                case 0:
+                    return false;
+                case 1:
+                    return true;
+                default:
+                    if (exchange_pop(index, b)) {
+                        return true;
+                    }
+            }
+        }
+    }
+
+    bool empty() const noexcept
+    {
+        return (head_.load(std::memory_order_acquire) & 0xffffffff) == 0;
+    }
+
+  private:
+    // Head word: tag << 32 | (index + 1), 0 if empty.
+    static uint64_t pack(uint64_t tag, uint64_t link) noexcept
+    {
+        return ((tag + 1) << 32) | link;
+    }
+
+    static size_t check_capacity(size_t capacity)
+    {
+        if (capacity > max_capacity) {
+            throw std::length_error("elimination_stack: capacity too large");
+        }
+        return capacity;
+    }
+
+    bool try_push(uint32_t index) noexcept
+    {
+        uint64_t head = head_.load(std::memory_order_relaxed);
+        next_[index].store(static_cast<uint32_t>(head),
+                           std::memory_order_relaxed);
+        return head_.compare_exchange_strong(head,
+                                             pack(head >> 32, index + 1),
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed);
+    }
+
+    // 0: empty, 1: popped, 2: lost the race for the head.
+    int try_pop(uint32_t& index) noexcept
+    {
+        uint64_t head = head_.load(std::memory_order_acquire);
+        uint32_t link = static_cast<uint32_t>(head);
+        if (link == 0) {
+            return 0;
+        }
+        // `next_` may be rewritten concurrently if `link` was popped in
+        // the meantime; the tag makes the CAS fail in that case.
+        uint32_t next = next_[link - 1].load(std::memory_order_relaxed);
+        if (head_.compare_exchange_strong(head,
+                                          pack(head >> 32, next),
+                                          std::memory_order_acquire,
+                                          std::memory_order_relaxed)) {
+            index = link - 1;
+            return 1;
+        }
+        return 2;
+    }
+
+    aligned_atomic<uint64_t, Align>& pick_slot(
+      elimination_impl::backoff& b) noexcept
+    {
+        if (b.rng == 0) {
+            b.rng = 0x9e3779b97f4a7c15ULL * (thread_registry::index() + 1);
+        }
+        return slots_[elimination_impl::xorshift(b.rng) % b.range];
+    }
+
+    // Met a slot in use: spread out.
+    void grow(elimination_impl::backoff& b) const noexcept
+    {
+        if (b.range < slots_.size()) {
+            ++b.range;
+        }
+    }
+
+    // Nobody came: gather in fewer slots.
+    static void shrink(elimination_impl::backoff& b) noexcept
+    {
+        if (b.range > 1) {
+            --b.range;
+        }
+    }
+
+    // Offers `index` to a popper; returns true if one took it.
+    bool exchange_push(uint32_t index, elimination_impl::backoff& b) noexcept
+    {
+        using namespace elimination_impl;
+        auto& slot = pick_slot(b);
+        uint64_t seen = slot.load(std::memory_order_acquire);
+        if (seen == pop_waiting) {
+            return slot.compare_exchange_strong(
+              seen, done | index, std::memory_order_release);
+        }
+        if (seen != vacant) {
+            grow(b);
+            return false;
+        }
+        uint64_t offer = push_waiting | index;
+        if (!slot.compare_exchange_strong(
+              seen, offer, std::memory_order_release)) {
+            grow(b);
+            return false;
+        }
+        for (size_t i = 0; i < patience; ++i) {
+            if (slot.load(std::memory_order_acquire) == done) {
+                slot.store(vacant, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        if (slot.compare_exchange_strong(offer, vacant)) {
+            shrink(b);
+            return false;
+        }
+        // Taken just now.
+        slot.store(vacant, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Waits for (or takes) an index from a pusher.
+    bool exchange_pop(uint32_t& index, elimination_impl::backoff& b) noexcept
+    {
+        using namespace elimination_impl;
+        auto& slot = pick_slot(b);
+        uint64_t seen = slot.load(std::memory_order_acquire);
+        if ((seen & state_mask) == push_waiting) {
+            if (slot.compare_exchange_strong(
+                  seen, done, std::memory_order_acquire)) {
+                index = static_cast<uint32_t>(seen);
+                return true;
+            }
+            return false;
+        }
+        if (seen != vacant) {
+            grow(b);
+            return false;
+        }
+        if (!slot.compare_exchange_strong(seen, pop_waiting)) {
+            grow(b);
+            return false;
+        }
+        for (size_t i = 0; i < patience; ++i) {
+            seen = slot.load(std::memory_order_acquire);
+            if ((seen & state_mask) == done) {
+                break;
+            }
+        }
+        if ((seen & state_mask) != done) {
+            seen = pop_waiting;
+            if (slot.compare_exchange_strong(
+                  seen, vacant, std::memory_order_acquire)) {
+                shrink(b);
+                return false;
+            }
+            // `seen` now holds the index given just now.
+        }
+        index = static_cast<uint32_t>(seen);
+        slot.store(vacant, std::memory_order_relaxed);
+        return true;
+    }
+
+    aligned_atomic<uint64_t, Align> head_{ 0 };
+    alloc_impl::aligned_array<std::atomic<uint32_t>> next_;
+    alloc_impl::aligned_array<aligned_atomic<uint64_t, Align>> slots_;
+    thread_slots<elimination_impl::backoff> backoff_;
+};
+
+template<size_t Align>
+constexpr size_t elimination_stack<Align>::max_capacity;
@@ -0,0 +1,224 @@
+// Copyright (c) 2021 Thomas Nagler
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "aligned_atomic.hpp"
+#include "thread_registry.hpp"
+
+#include <algorithm> // std::sort, std::binary_search
+#include <cstdint>   // uint64_t
+#include <mutex>     // std::mutex, std::lock_guard
+#include <new>       // std::bad_alloc
+#include <vector>    // std::vector
+
+namespace faa_queue_impl {
+
+// Marks a cell whose item was taken (or that a dequeuer gave up on).
+inline void*
+taken() noexcept
+{
+    static char marker;
+    return &marker;
+}
+
+// Array of cells with its own enqueue and dequeue indices, each on a line
+// of its own. Indices only grow; cells past `Size` don't exist.
+template<class T, size_t Size, size_t Align>
+struct segment
+{
+    aligned_atomic<uint64_t, Align> deq_idx{ 0 };
+    aligned_atomic<uint64_t, Align> enq_idx{ 0 };
+    aligned_atomic<segment*, Align> next{ nullptr };
+    std::atomic<void*> cells[Size];
+
+    explicit segment(T* first) noexcept
+    {
+        cells[0].store(first, std::memory_order_relaxed);
+        for (size_t i = 1; i < Size; ++i) {
+            cells[i].store(nullptr, std::memory_order_relaxed);
+        }
+        enq_idx.store(first == nullptr ? 0 : 1, std::memory_order_relaxed);
+    }
+
+    static void* operator new(size_t count)
+    {
+        void* p = alloc_impl::aligned_malloc(count, alignof(segment));
+        if (p == nullptr) {
+            throw std::bad_alloc();
+        }
+        return p;
+    }
+
+    static void operator delete(void* ptr) { alloc_impl::aligned_free(ptr); }
+};
+
+} // end namespace faa_queue_impl
+
+// Unbounded multi-producer, multi-consumer queue of pointers after Correia
+// and Ramalhete's FAAArrayQueue. Enqueuers and dequeuers claim cells of a
+// segment with `fetch_add()` on the segment's tail and head index, so that
+// contended threads don't retry failed CASes; a new segment is linked in
+// when one runs full. Retired segments are freed once no thread holds a
+// hazard pointer to them.
+//
+// The queue doesn't own the items. `nullptr` can't be enqueued.
+template<class T, size_t SegmentSize = 1024, size_t Align = 64>
+class faa_queue
+{
+    static_assert(SegmentSize > 0, "SegmentSize must be positive.");
+
+    using segment = faa_queue_impl::segment<T, SegmentSize, Align>;
+
+  public:
+    faa_queue()
+    {
+        segment* s = new segment(nullptr);
+        head_.store(s, std::memory_order_relaxed);
+        tail_.store(s, std::memory_order_relaxed);
+    }
+
+    faa_queue(const faa_queue&) = delete;
+    faa_queue& operator=(const faa_queue&) = delete;
+
+    // Must not run concurrently with other operations.
+    ~faa_queue()
+    {
+        segment* s = head_.load(std::memory_order_relaxed);
+        while (s != nullptr) {
+            segment* next = s->next.load(std::memory_order_relaxed);
+            delete s;
+            s = next;
+        }
+        for (segment* r : retired_) {
+            delete r;
+        }
+    }
+
+    void push(T* item)
+    {
+        auto& hazard = hazards_.local();
+        while (true) {
+            segment* tail = protect(tail_, hazard);
+            uint64_t i = tail->enq_idx.fetch_add(1);
+            if (i < SegmentSize) {
+                void* expected = nullptr;
+                if (tail->cells[i].compare_exchange_strong(expected, item)) {
+                    break;
+                }
+                continue; // a dequeuer got there first
+            }
+            // Segment is full: help to link a new one.
+            if (tail != tail_.load()) {
+                continue;
+            }
+            segment* next = tail->next.load();
+            if (next == nullptr) {
+                segment* fresh = new segment(item);
+                if (tail->next.compare_exchange_strong(next, fresh)) {
+                    tail_.compare_exchange_strong(tail, fresh);
+                    break;
+                }
+                delete fresh;
+            } else {
+                tail_.compare_exchange_strong(tail, next);
+            }
+        }
+        hazard.store(nullptr, std::memory_order_release);
+    }
+
+    // Oldest item, or `nullptr` if the queue is empty.
+    T* pop()
+    {
+        auto& hazard = hazards_.local();
+        T* item = nullptr;
+        while (true) {
+            segment* head = protect(head_, hazard);
+            if (head->deq_idx.load() >= head->enq_idx.load() &&
+                head->next.load() == nullptr) {
+                break;
+            }
+            uint64_t i = head->deq_idx.fetch_add(1);
+            if (i < SegmentSize) {
+                void* p = head->cells[i].exchange(faa_queue_impl::taken());
+                if (p == nullptr) {
+                    continue; // overtook the enqueuer; it will retry
+                }
+                item = static_cast<T*>(p);
+                break;
+            }
+            // Segment is drained: move on to the next one.
+            segment* next = head->next.load();
+            if (next == nullptr) {
+                break;
+            }
+            if (head_.compare_exchange_strong(head, next)) {
+                hazard.store(nullptr, std::memory_order_release);
+                retire(head);
+            }
+        }
+        hazard.store(nullptr, std::memory_order_release);
+        return item;
+    }
+
+  private:
+    using hazard_type = aligned_atomic<segment*, Align>;
+
+    static segment* protect(const aligned_atomic<segment*, Align>& src,
+                            hazard_type& hazard) noexcept
+    {
+        segment* s = src.load();
+        while (true) {
+            hazard.store(s); // seq_cst: ordered before the reload
+            segment* again = src.load();
+            if (again == s) {
+                return s;
+            }
+            s = again;
+        }
+    }
+
+    // Frees retired segments that no thread protects (anymore).
+    void retire(segment* s)
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        retired_.push_back(s);
+        std::vector<segment*> in_use;
+        hazards_.for_each([&in_use](hazard_type& h) {
+            segment* p = h.load();
+            if (p != nullptr) {
+                in_use.push_back(p);
+            }
+        });
+        std::sort(in_use.begin(), in_use.end());
+        size_t kept = 0;
+        for (segment* r : retired_) {
+            if (std::binary_search(in_use.begin(), in_use.end(), r)) {
+                retired_[kept++] = r;
+            } else {
+                delete r;
+            }
+        }
+        retired_.resize(kept);
+    }
+
+    aligned_atomic<segment*, Align> head_;
+    aligned_atomic<segment*, Align> tail_;
+    thread_slots<hazard_type> hazards_;
+    std::mutex mtx_;
+    std::vector<segment*> retired_;
+};
@@ -0,0 +1,245 @@
+// Copyright (c) 2021 Thomas Nagler
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "aligned_atomic.hpp"
+#include "hash_mix.hpp"
+#include "thread_registry.hpp"
+
+#include <cmath>      // std::ldexp, std::log
+#include <cstdint>    // uint8_t, uint32_t, uint64_t
+#include <functional> // std::hash
+
+namespace hll_impl {
+
+// Raises byte `i` of `word` to at least `value`; returns false if it
+// already was. Registers are packed eight to a word, and the CAS only
+// retries if a register in the same word changed concurrently.
+inline bool
+byte_max(std::atomic<uint64_t>& word, size_t i, uint64_t value) noexcept
+{
+    size_t shift = 8 * i;
+    uint64_t old = word.load(std::memory_order_relaxed);
+    while (((old >> shift) & 0xff) < value) {
+        uint64_t raised = (old & ~(uint64_t(0xff) << shift)) | (value << shift);
+        if (word.compare_exchange_weak(
+              old, raised, std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Number of leading zeros of `x` plus one, capped at `max`.
+inline uint64_t
+rank(uint64_t x, uint64_t max) noexcept
+{
+#if defined(__GNUC__)
+    uint64_t r = x == 0 ? max : static_cast<uint64_t>(__builtin_clzll(x)) + 1;
+    return r < max ? r : max;
+#else
+    uint64_t r = 1;
+    while (r < max && (x & (uint64_t(1) << 63)) == 0) {
+        x <<= 1;
+        ++r;
+    }
+    return r;
+#endif
+}
+
+} // end namespace hll_impl
+
+// HyperLogLog cardinality estimator (Flajolet et al., 2007) with `2^P`
+// one-byte registers packed into `Align`-aligned lines of 64-bit words.
+// Registers are raised with a lock-free byte-max (CAS on the containing
+// word), so any number of threads can `add()` at once. The standard error
+// is about `1.04 / sqrt(2^P)` (0.8% for P = 14).
+//
+// `add_buffered()` pre-aggregates in a small per-thread buffer and publishes
+// the buffered register ranks in one pass when it is full or on `flush()`.
+// Each thread must `flush()` before its updates are guaranteed to be
+// visible to `estimate()`.
+template<class Key,
+         size_t P = 14,
+         class Hash = std::hash<Key>,
+         size_t Align = 64>
+class hyperloglog
+{
+    static_assert(P >= 4 && P <= 18, "P must be in [4, 18].");
+
+  public:
+    static constexpr size_t num_registers = size_t(1) << P;
+
+    hyperloglog()
+      : lines_(num_registers / 8 / words_per_line > 0
+                 ? num_registers / 8 / words_per_line
+                 : 1)
+    {}
+
+    hyperloglog(const hyperloglog&) = delete;
+    hyperloglog& operator=(const hyperloglog&) = delete;
+
+    ~hyperloglog()
+    {
+        buffers_.for_each([](std::atomic<buffer*>& b) { delete b.load(); });
+    }
+
+    void add(const Key& key) noexcept { add_hash(hash_(key)); }
+
+    // Like `add()`, but collects registers in a per-thread buffer first.
+    void add_buffered(const Key& key)
+    {
+        buffer& b = local();
+        uint64_t h = hash_impl::mix64(hash_(key));
+        uint32_t reg = static_cast<uint32_t>(h >> (64 - P));
+        uint8_t r = static_cast<uint8_t>(rank_of(h));
+        for (size_t i = 0; i < b.size; ++i) {
+            if (b.entries[i].reg == reg) {
+                if (r > b.entries[i].rank) {
+                    b.entries[i].rank = r;
+                }
+                return;
+            }
+        }
+        b.entries[b.size++] = { reg, r };
+        if (b.size == buffer::capacity) {
+            publish(b);
+        }
+    }
+
+    // Publishes the calling thread's buffer.
+    void flush() { publish(local()); }
+
+    // Estimated number of distinct keys added (unbuffered or flushed).
+    double estimate() const noexcept
+    {
+        const double m = static_cast<double>(num_registers);
+        double sum = 0;
+        size_t zeros = 0;
+        for (size_t i = 0; i < num_registers; ++i) {
+            int r = static_cast<int>(get(i));
+            sum += std::ldexp(1.0, -r);
+            zeros += (r == 0);
+        }
+        double e = alpha() * m * m / sum;
+        if (e <= 2.5 * m && zeros > 0) {
+            // Small range correction (linear counting).
+            return m * std::log(m / static_cast<double>(zeros));
+        }
+        return e;
+    }
+
+    // Raises every register of `*this` to that of `other` (union).
+    void merge(const hyperloglog& other) noexcept
+    {
+        for (size_t i = 0; i < num_registers; ++i) {
+            hll_impl::byte_max(word(i), i % 8, other.get(i));
+        }
+    }
+
+  private:
+    static constexpr size_t words_per_line = Align / 8;
+
+    // Bias correction of the raw estimate (Flajolet et al., 2007); the
+    // closed form only holds from 128 registers on.
+    static constexpr double alpha() noexcept
+    {
+        return P == 4   ? 0.673
+               : P == 5 ? 0.697
+               : P == 6 ? 0.709
+                        : 0.7213 / (1 + 1.079 / double(num_registers));
+    }
+
+    struct alignas(Align) line
+    {
+        std::atomic<uint64_t> words[words_per_line];
+    };
+
+    // Distinct registers touched by one thread since its last flush.
+    struct buffer
+    {
+        static constexpr size_t capacity = 64;
+
+        struct entry
+        {
+            uint32_t reg;
+            uint8_t rank;
+        };
+
+        size_t size{ 0 };
+        entry entries[capacity];
+    };
+
+    static uint64_t rank_of(uint64_t h) noexcept
+    {
+        return hll_impl::rank(h << P, 64 - P + 1);
+    }
+
+    void add_hash(uint64_t hash) noexcept
+    {
+        uint64_t h = hash_impl::mix64(hash);
+        size_t reg = static_cast<size_t>(h >> (64 - P));
+        hll_impl::byte_max(word(reg), reg % 8, rank_of(h));
+    }
+
+    // Word holding register `reg`.
+    std::atomic<uint64_t>& word(size_t reg) noexcept
+    {
+        size_t w = reg / 8;
+        return lines_[w / words_per_line].words[w % words_per_line];
+    }
+
+    const std::atomic<uint64_t>& word(size_t reg) const noexcept
+    {
+        return const_cast<hyperloglog*>(this)->word(reg);
+    }
+
+    // Value of register `reg`.
+    uint64_t get(size_t reg) const noexcept
+    {
+        uint64_t w = word(reg).load(std::memory_order_relaxed);
+        return (w >> (8 * (reg % 8))) & 0xff;
+    }
+
+    void publish(buffer& b) noexcept
+    {
+        for (size_t i = 0; i < b.size; ++i) {
+            size_t reg = b.entries[i].reg;
+            hll_impl::byte_max(word(reg), reg % 8, b.entries[i].rank);
+        }
+        b.size = 0;
+    }
+
+    buffer& local()
+    {
+        std::atomic<buffer*>& slot = buffers_.local();
+        buffer* b = slot.load(std::memory_order_relaxed);
+        if (b == nullptr) {
+            b = new buffer;
+            slot.store(b, std::memory_order_relaxed);
+        }
+        return *b;
+    }
+
+    alloc_impl::aligned_array<line> lines_;
+    thread_slots<std::atomic<buffer*>> buffers_;
+    Hash hash_;
+};
+
+template<class Key, size_t P, class Hash, size_t Align>
+constexpr size_t hyperloglog<Key, P, Hash, Align>::num_registers;
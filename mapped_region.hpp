@@ -0,0 +1,199 @@
+// Copyright (c) 2021 Thomas Nagler
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <cerrno>       // errno
+#include <cstddef>      // size_t
+#include <string>       // std::string
+#include <system_error> // std::system_error
+#include <utility>      // std::swap
+
+#include <fcntl.h>    // O_* constants
+#include <sys/mman.h> // mmap, munmap, msync, shm_open, shm_unlink
+#include <sys/stat.h> // fstat
+#include <unistd.h>   // close, ftruncate
+
+namespace mapping_impl {
+
+// Callers that clean up before throwing must save `errno` first and pass it
+// as `err`.
+[[noreturn]] inline void
+throw_errno(const std::string& what, int err = errno)
+{
+    throw std::system_error(err, std::generic_category(), what);
+}
+
+} // end namespace mapping_impl
+
+// Shared memory mapping of a file, POSIX shared memory object, or memfd
+// (Linux only). Owns the mapping and the file descriptor; both are released on
+// destruction. Errors are reported as `std::system_error`.
+class mapped_region
+{
+  public:
+    enum class access
+    {
+        read_only,
+        read_write
+    };
+
+    mapped_region() noexcept = default;
+
+    // Maps the file behind `fd` and takes ownership of the descriptor.
+    // `size == 0` maps the whole file.
+    mapped_region(int fd, access mode, size_t size = 0)
+      : fd_(fd)
+    {
+        if (size == 0) {
+            struct stat st;
+            if (fstat(fd_, &st) != 0) {
+                int err = errno;
+                close_fd();
+                mapping_impl::throw_errno("fstat", err);
+            }
+            size = static_cast<size_t>(st.st_size);
+        }
+        int prot = PROT_READ | (mode == access::read_write ? PROT_WRITE : 0);
+        void* addr = mmap(nullptr, size, prot, MAP_SHARED, fd_, 0);
+        if (addr == MAP_FAILED) {
+            int err = errno;
+            close_fd();
+            mapping_impl::throw_errno("mmap", err);
+        }
+        data_ = addr;
+        size_ = size;
+    }
+
+    mapped_region(mapped_region&& other) noexcept { swap(other); }
+
+    mapped_region& operator=(mapped_region&& other) noexcept
+    {
+        swap(other);
+        return *this;
+    }
+
+    mapped_region(const mapped_region&) = delete;
+    mapped_region& operator=(const mapped_region&) = delete;
+
+    ~mapped_region()
+    {
+        if (data_) {
+            munmap(data_, size_);
+        }
+        close_fd();
+    }
+
+    // Creates (or opens, if `exclusive` is false) the POSIX shared memory
+    // object `name` (e.g. "/my_stats") with at least the given size.
+    static mapped_region create_shm(const std::string& name,
+                                    size_t size,
+                                    bool exclusive = true)
+    {
+        int flags = O_RDWR | O_CREAT | (exclusive ? O_EXCL : 0);
+        return create(shm_open(name.c_str(), flags, 0644), size, "shm_open");
+    }
+
+    // Opens an existing POSIX shared memory object.
+    static mapped_region open_shm(const std::string& name, access mode)
+    {
+        int flags = (mode == access::read_write) ? O_RDWR : O_RDONLY;
+        int fd = shm_open(name.c_str(), flags, 0);
+        if (fd < 0) {
+            mapping_impl::throw_errno("shm_open");
+        }
+        return mapped_region(fd, mode);
+    }
+
+#if defined(__linux__)
+    // Creates an anonymous memory file. Other processes can map it through
+    // `fd()` (passed over a Unix socket or inherited) or
+    // `/proc/<pid>/fd/<fd>`.
+    static mapped_region create_memfd(const std::string& name, size_t size)
+    {
+        return create(memfd_create(name.c_str(), 0), size, "memfd_create");
+    }
+#endif
+
+    // Creates or opens a regular file. A file that is shorter than `size` is
+    // extended with zeros, a longer file is mapped in full.
+    static mapped_region open_file(const std::string& path, size_t size)
+    {
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        return create(fd, size, "open");
+    }
+
+    // Removes the name of a POSIX shared memory object. Existing mappings
+    // stay valid.
+    static void unlink_shm(const std::string& name) noexcept
+    {
+        shm_unlink(name.c_str());
+    }
+
+    // Writes dirty pages back to the underlying file.
+    void sync(bool async = false)
+    {
+        if (msync(data_, size_, async ? MS_ASYNC : MS_SYNC) != 0) {
+            mapping_impl::throw_errno("msync");
+        }
+    }
+
+    void* data() const noexcept { return data_; }
+    size_t size() const noexcept { return size_; }
+    int fd() const noexcept { return fd_; }
+
+    void swap(mapped_region& other) noexcept
+    {
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        std::swap(fd_, other.fd_);
+    }
+
+  private:
+    // Grows the file to `size` bytes if necessary and maps all of it.
+    static mapped_region create(int fd, size_t size, const char* what)
+    {
+        if (fd < 0) {
+            mapping_impl::throw_errno(what);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            int err = errno;
+            ::close(fd);
+            mapping_impl::throw_errno("fstat", err);
+        }
+        if (static_cast<size_t>(st.st_size) < size &&
+            ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            int err = errno;
+            ::close(fd);
+            mapping_impl::throw_errno("ftruncate", err);
+        }
+        return mapped_region(fd, access::read_write);
+    }
+
+    void close_fd() noexcept
+    {
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    void* data_{ nullptr };
+    size_t size_{ 0 };
+    int fd_{ -1 };
+};
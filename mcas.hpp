@@ -0,0 +1,408 @@
+// Copyright (c) 2021 Thomas Nagler
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "thread_registry.hpp"
+
+#include <algorithm>        // std::sort
+#include <cassert>          // assert
+#include <cstdint>          // uintptr_t, uint64_t
+#include <initializer_list> // std::initializer_list
+#include <stdexcept>        // std::length_error
+
+// Maximum number of words changed by one `mcas()`.
+constexpr size_t mcas_max_words = 8;
+
+// One word of a multi-word compare-and-swap: `*target` is set to `desired` if
+// it equals `expected`. The two lowest bits of both values must be zero
+// (e.g., pointers to 4-byte aligned objects or integers shifted by two).
+struct mcas_entry
+{
+    std::atomic<uintptr_t>* target;
+    uintptr_t expected;
+    uintptr_t desired;
+};
+
+// Lock-free multi-word compare-and-swap after Harris, Fraser, and Pratt ("A
+// practical multi-word compare-and-swap operation", 2002).
+//
+// While an operation is in progress, its targets hold references to a
+// descriptor instead of values. Other threads that run into such a reference
+// help the operation to complete. Descriptors are not allocated per
+// operation: each thread owns one MCAS and one RDCSS descriptor that it
+// reuses for all of its operations. References carry the sequence number of
+// the operation they belong to, so that helpers can tell whether the
+// descriptor they just read still describes that operation (Arbel-Raviv and
+// Brown, "Reuse, don't recycle", 2017).
+namespace mcas_impl {
+
+static_assert(sizeof(uintptr_t) == 8, "mcas requires 64-bit words.");
+
+// Word layout: value << 2 | 0, or seq << 18 | thread << 2 | kind.
+constexpr uintptr_t kind_mask = 3;
+constexpr uintptr_t mcas_kind = 1;
+constexpr uintptr_t rdcss_kind = 2;
+constexpr size_t thread_bits = 16;
+constexpr size_t max_threads = size_t(1) << thread_bits;
+
+// Status word of an MCAS descriptor: seq << 2 | state.
+constexpr uintptr_t undecided = 0;
+constexpr uintptr_t succeeded = 1;
+constexpr uintptr_t failed = 2;
+constexpr uintptr_t state_mask = 3;
+
+inline uintptr_t
+make_ref(uintptr_t kind, size_t thread, uint64_t seq) noexcept
+{
+    return (static_cast<uintptr_t>(seq) << (thread_bits + 2)) |
+           (static_cast<uintptr_t>(thread) << 2) | kind;
+}
+
+inline size_t
+thread_of(uintptr_t ref) noexcept
+{
+    return (ref >> 2) & (max_threads - 1);
+}
+
+inline uint64_t
+seq_of(uintptr_t ref) noexcept
+{
+    return ref >> (thread_bits + 2);
+}
+
+// Descriptor fields are atomics because helpers read them while the owner
+// may already be reusing the descriptor. `seq` is odd while the owner
+// rewrites the fields and even otherwise (seqlock).
+struct mcas_descriptor
+{
+    std::atomic<uint64_t> seq;
+    std::atomic<uintptr_t> status;
+    std::atomic<size_t> size;
+    std::atomic<std::atomic<uintptr_t>*> target[mcas_max_words];
+    std::atomic<uintptr_t> expected[mcas_max_words];
+    std::atomic<uintptr_t> desired[mcas_max_words];
+};
+
+// Double-compare single-swap: sets `*target` from `expected` to `mcas_ref`
+// only if the MCAS operation `mcas_ref` is still undecided.
+struct rdcss_descriptor
+{
+    std::atomic<uint64_t> seq;
+    std::atomic<std::atomic<uintptr_t>*> target;
+    std::atomic<uintptr_t> expected;
+    std::atomic<uintptr_t> mcas_ref;
+};
+
+struct alignas(64) thread_descriptors
+{
+    mcas_descriptor mcas;
+    rdcss_descriptor rdcss;
+};
+
+inline thread_slots<thread_descriptors>&
+descriptors()
+{
+    static thread_slots<thread_descriptors> slots;
+    return slots;
+}
+
+// Private copies of descriptor fields, taken by helpers.
+struct mcas_snapshot
+{
+    uintptr_t ref;
+    size_t size;
+    std::atomic<uintptr_t>* target[mcas_max_words];
+    uintptr_t expected[mcas_max_words];
+    uintptr_t desired[mcas_max_words];
+};
+
+struct rdcss_snapshot
+{
+    uintptr_t ref;
+    std::atomic<uintptr_t>* target;
+    uintptr_t expected;
+    uintptr_t mcas_ref;
+};
+
+// Starts rewriting a descriptor; returns the sequence number the descriptor
+// will have once `publish()` is called.
+inline uint64_t
+begin_update(std::atomic<uint64_t>& seq) noexcept
+{
+    uint64_t s = seq.load(std::memory_order_relaxed);
+    seq.store(s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    return s + 2;
+}
+
+inline void
+publish(std::atomic<uint64_t>& seq, uint64_t s) noexcept
+{
+    seq.store(s, std::memory_order_release);
+}
+
+// Whether the fields read before this call still belong to operation `s`.
+inline bool
+validate(const std::atomic<uint64_t>& seq, uint64_t s) noexcept
+{
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return seq.load(std::memory_order_relaxed) == s;
+}
+
+inline bool
+read_rdcss(uintptr_t ref, rdcss_snapshot& s)
+{
+    const rdcss_descriptor& d = descriptors()[thread_of(ref)].rdcss;
+    s.ref = ref;
+    s.target = d.target.load(std::memory_order_relaxed);
+    s.expected = d.expected.load(std::memory_order_relaxed);
+    s.mcas_ref = d.mcas_ref.load(std::memory_order_relaxed);
+    return validate(d.seq, seq_of(ref));
+}
+
+inline bool
+read_mcas(uintptr_t ref, mcas_snapshot& s)
+{
+    const mcas_descriptor& d = descriptors()[thread_of(ref)].mcas;
+    s.ref = ref;
+    s.size = d.size.load(std::memory_order_relaxed);
+    if (s.size > mcas_max_words) {
+        return false;
+    }
+    for (size_t i = 0; i < s.size; ++i) {
+        s.target[i] = d.target[i].load(std::memory_order_relaxed);
+        s.expected[i] = d.expected[i].load(std::memory_order_relaxed);
+        s.desired[i] = d.desired[i].load(std::memory_order_relaxed);
+    }
+    return validate(d.seq, seq_of(ref));
+}
+
+inline std::atomic<uintptr_t>&
+status_of(uintptr_t mcas_ref)
+{
+    return descriptors()[thread_of(mcas_ref)].mcas.status;
+}
+
+// Second half of RDCSS: replaces the RDCSS reference by the MCAS reference
+// if the operation is still undecided, and by the old value otherwise.
+inline void
+complete_rdcss(const rdcss_snapshot& s)
+{
+    uintptr_t status = status_of(s.mcas_ref).load();
+    bool undecided_now = status == (seq_of(s.mcas_ref) << 2 | undecided);
+    uintptr_t expected = s.ref;
+    s.target->compare_exchange_strong(
+      expected, undecided_now ? s.mcas_ref : s.expected);
+}
+
+inline void
+help_rdcss(uintptr_t ref)
+{
+    rdcss_snapshot s;
+    if (read_rdcss(ref, s)) {
+        complete_rdcss(s);
+    }
+    // Otherwise, the operation has completed and `ref` is gone.
+}
+
+// Installs `mcas_ref` in `target` if it holds `expected` and the operation
+// is undecided. Returns the value found in `target` (`expected` on success).
+inline uintptr_t
+rdcss(std::atomic<uintptr_t>* target, uintptr_t expected, uintptr_t mcas_ref)
+{
+    size_t self = thread_registry::index();
+    rdcss_descriptor& d = descriptors()[self].rdcss;
+    uint64_t seq = begin_update(d.seq);
+    d.target.store(target, std::memory_order_relaxed);
+    d.expected.store(expected, std::memory_order_relaxed);
+    d.mcas_ref.store(mcas_ref, std::memory_order_relaxed);
+    publish(d.seq, seq);
+
+    rdcss_snapshot s{ make_ref(rdcss_kind, self, seq), target, expected,
+                      mcas_ref };
+    while (true) {
+        uintptr_t found = expected;
+        if (target->compare_exchange_strong(found, s.ref)) {
+            complete_rdcss(s);
+            return expected;
+        }
+        if ((found & kind_mask) != rdcss_kind) {
+            return found;
+        }
+        help_rdcss(found);
+    }
+}
+
+inline bool help_mcas(const mcas_snapshot& s);
+
+inline void
+help_mcas_ref(uintptr_t ref)
+{
+    mcas_snapshot s;
+    if (read_mcas(ref, s)) {
+        help_mcas(s);
+    }
+}
+
+// Drives the operation described by `s` to completion. Returns whether it
+// succeeded (only meaningful while the descriptor hasn't been reused, which
+// is always the case for its owner).
+inline bool
+help_mcas(const mcas_snapshot& s)
+{
+    uint64_t seq = seq_of(s.ref);
+    std::atomic<uintptr_t>& status = status_of(s.ref);
+    uintptr_t open = seq << 2 | undecided;
+
+    // Phase 1: install references in all targets.
+    if (status.load() == open) {
+        uintptr_t outcome = succeeded;
+        for (size_t i = 0; i < s.size && outcome == succeeded; ++i) {
+            while (true) {
+                uintptr_t found = rdcss(s.target[i], s.expected[i], s.ref);
+                if (found == s.expected[i] || found == s.ref) {
+                    break;
+                }
+                if ((found & kind_mask) == mcas_kind) {
+                    help_mcas_ref(found);
+                    continue;
+                }
+                outcome = failed;
+                break;
+            }
+        }
+        status.compare_exchange_strong(open, seq << 2 | outcome);
+    }
+
+    // Phase 2: replace references by the new or old values. Pending RDCSS
+    // installs are completed first (they will back off, since the operation
+    // is decided), so that no reference can be left behind once the owner
+    // moves on to its next operation.
+    uintptr_t final_status = status.load();
+    if ((final_status >> 2) != seq) {
+        return false;
+    }
+    bool success = (final_status & state_mask) == succeeded;
+    for (size_t i = 0; i < s.size; ++i) {
+        uintptr_t value = success ? s.desired[i] : s.expected[i];
+        uintptr_t found = s.target[i]->load();
+        while (found == s.ref || (found & kind_mask) == rdcss_kind) {
+            if (found == s.ref) {
+                s.target[i]->compare_exchange_strong(found, value);
+            } else {
+                help_rdcss(found);
+            }
+            found = s.target[i]->load();
+        }
+    }
+    return success;
+}
+
+} // end namespace mcas_impl
+
+// Reads a word that may be the target of concurrent `mcas()` operations.
+// Plain loads may observe descriptor references and must not be used.
+inline uintptr_t
+mcas_read(const std::atomic<uintptr_t>& target)
+{
+    using namespace mcas_impl;
+    while (true) {
+        uintptr_t value = target.load();
+        switch (value & kind_mask) {
+            case 0:
+                return value;
+            case rdcss_kind:
+                help_rdcss(value);
+                break;
+            default:
+                help_mcas_ref(value);
+        }
+    }
+}
+
+// Atomically sets `*e.target = e.desired` for all entries if
+// `*e.target == e.expected` for all entries; returns whether it did. Targets
+// must be distinct and may only be read with `mcas_read()` and written with
+// `mcas()`. The entries are sorted by target address in place.
+inline bool
+mcas(mcas_entry* entries, size_t size)
+{
+    using namespace mcas_impl;
+    if (size > mcas_max_words) {
+        throw std::length_error("mcas: too many words");
+    }
+    if (size == 0) {
+        return true;
+    }
+    if (size == 1) {
+        // A single word needs no descriptor.
+        mcas_entry& e = entries[0];
+        while (true) {
+            uintptr_t found = e.expected;
+            if (e.target->compare_exchange_strong(found, e.desired)) {
+                return true;
+            }
+            if ((found & kind_mask) == 0) {
+                return false;
+            }
+            mcas_read(*e.target);
+        }
+    }
+
+    // A global order of targets guarantees that helping terminates.
+    std::sort(entries,
+              entries + size,
+              [](const mcas_entry& a, const mcas_entry& b) {
+                  return a.target < b.target;
+              });
+
+    size_t self = thread_registry::index();
+    if (self >= max_threads) {
+        throw std::length_error("mcas: too many threads");
+    }
+    mcas_descriptor& d = descriptors()[self].mcas;
+    mcas_snapshot s;
+    uint64_t seq = begin_update(d.seq);
+    s.ref = make_ref(mcas_kind, self, seq);
+    s.size = size;
+    d.size.store(size, std::memory_order_relaxed);
+    for (size_t i = 0; i < size; ++i) {
+        assert(((entries[i].expected | entries[i].desired) & kind_mask) == 0);
+        assert(i == 0 || entries[i].target != entries[i - 1].target);
+        s.target[i] = entries[i].target;
+        s.expected[i] = entries[i].expected;
+        s.desired[i] = entries[i].desired;
+        d.target[i].store(s.target[i], std::memory_order_relaxed);
+        d.expected[i].store(s.expected[i], std::memory_order_relaxed);
+        d.desired[i].store(s.desired[i], std::memory_order_relaxed);
+    }
+    d.status.store(seq << 2 | undecided, std::memory_order_relaxed);
+    publish(d.seq, seq);
+    return help_mcas(s);
+}
+
+inline bool
+mcas(std::initializer_list<mcas_entry> entries)
+{
+    mcas_entry copy[mcas_max_words];
+    if (entries.size() > mcas_max_words) {
+        throw std::length_error("mcas: too many words");
+    }
+    std::copy(entries.begin(), entries.end(), copy);
+    return mcas(copy, entries.size());
+}
@@ -0,0 +1,275 @@
+// Copyright (c) 2021 Thomas Nagler
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "aligned_atomic.hpp"
+#include "thread_registry.hpp"
+
+#include <chrono>    // std::chrono::steady_clock
+#include <cmath>     // std::exp, std::llround, std::log
+#include <cstdint>   // int64_t, uint64_t
+#include <limits>    // std::numeric_limits
+#include <stdexcept> // std::invalid_argument
+
+namespace moments_impl {
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+              "64-bit atomics must be lock-free.");
+
+// Single-writer sequence lock around the fields of a per-thread slot.
+inline uint64_t
+begin_write(std::atomic<uint64_t>& seq) noexcept
+{
+    uint64_t s = seq.load(std::memory_order_relaxed);
+    seq.store(s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    return s + 2;
+}
+
+inline void
+end_write(std::atomic<uint64_t>& seq, uint64_t s) noexcept
+{
+    seq.store(s, std::memory_order_release);
+}
+
+// Copies a slot with `read(slot)` until no write overlapped the copy.
+template<class Slot, class Read>
+void
+read_consistent(const Slot& slot, Read read)
+{
+    while (true) {
+        uint64_t before = slot.seq.load(std::memory_order_acquire);
+        if (before & 1) {
+            continue;
+        }
+        read(slot);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) == before) {
+            return;
+        }
+    }
+}
+
+template<size_t Align>
+struct alignas(Align) moments_slot
+{
+    std::atomic<uint64_t> seq;
+    std::atomic<uint64_t> count;
+    std::atomic<double> mean;
+    std::atomic<double> m2;
+};
+
+template<size_t Align>
+struct alignas(Align) ewma_slot
+{
+    std::atomic<uint64_t> seq;
+    std::atomic<double> sum;
+    std::atomic<double> weight;
+    std::atomic<int64_t> last; // time of the last update (ticks)
+};
+
+} // end namespace moments_impl
+
+// Count, mean, and variance of a stream of values. Every thread updates its
+// own slot (Welford's algorithm) under a single-writer sequence lock; reads
+// combine the slots with Chan et al.'s parallel formulas. Updates are plain
+// stores on a line that no other thread writes.
+template<size_t Align = 64>
+class running_moments
+{
+    using slot = moments_impl::moments_slot<Align>;
+
+  public:
+    struct result
+    {
+        uint64_t count;
+        double mean;
+        double variance; // sample variance (n - 1 in the denominator)
+    };
+
+    running_moments() = default;
+    running_moments(const running_moments&) = delete;
+    running_moments& operator=(const running_moments&) = delete;
+
+    void add(double x)
+    {
+        slot& s = slots_.local();
+        uint64_t n = s.count.load(std::memory_order_relaxed) + 1;
+        double mean = s.mean.load(std::memory_order_relaxed);
+        double m2 = s.m2.load(std::memory_order_relaxed);
+        double delta = x - mean;
+        mean += delta / static_cast<double>(n);
+        m2 += delta * (x - mean);
+
+        uint64_t seq = moments_impl::begin_write(s.seq);
+        s.count.store(n, std::memory_order_relaxed);
+        s.mean.store(mean, std::memory_order_relaxed);
+        s.m2.store(m2, std::memory_order_relaxed);
+        moments_impl::end_write(s.seq, seq);
+    }
+
+    result get() const
+    {
+        double n = 0, mean = 0, m2 = 0;
+        slots_.for_each([&](const slot& s) {
+            double nb, mean_b, m2_b;
+            moments_impl::read_consistent(s, [&](const slot& c) {
+                nb = static_cast<double>(
+                  c.count.load(std::memory_order_relaxed));
+                mean_b = c.mean.load(std::memory_order_relaxed);
+                m2_b = c.m2.load(std::memory_order_relaxed);
+            });
+            if (nb == 0) {
+                return;
+            }
+            double total = n + nb;
+            double delta = mean_b - mean;
+            mean += delta * nb / total;
+            m2 += m2_b + delta * delta * n * nb / total;
+            n = total;
+        });
+        return result{ static_cast<uint64_t>(n),
+                       mean,
+                       n > 1 ? m2 / (n - 1) : 0.0 };
+    }
+
+  private:
+    mutable thread_slots<slot> slots_;
+};
+
+// Exponentially weighted moving average with time-based decay: a sample's
+// weight halves every `half_life`. Every thread keeps the decayed sum and
+// weight of its own samples in a slot of its own; since decay is a common
+// factor, reads combine the slots exactly by decaying them to the present.
+template<size_t Align = 64>
+class ewma
+{
+    using slot = moments_impl::ewma_slot<Align>;
+
+  public:
+    using clock = std::chrono::steady_clock;
+
+    explicit ewma(clock::duration half_life)
+      : rate_(check(half_life))
+      , start_(clock::now())
+    {}
+
+    ewma(const ewma&) = delete;
+    ewma& operator=(const ewma&) = delete;
+
+    void add(double x, clock::time_point now = clock::now())
+    {
+        slot& s = slots_.local();
+        int64_t t = ticks(now);
+        int64_t last = s.last.load(std::memory_order_relaxed);
+        double decay = t > last ? std::exp(-rate_ * (t - last)) : 1.0;
+        double sum = s.sum.load(std::memory_order_relaxed) * decay + x;
+        double weight = s.weight.load(std::memory_order_relaxed) * decay + 1;
+
+        uint64_t seq = moments_impl::begin_write(s.seq);
+        s.sum.store(sum, std::memory_order_relaxed);
+        s.weight.store(weight, std::memory_order_relaxed);
+        s.last.store(t > last ? t : last, std::memory_order_relaxed);
+        moments_impl::end_write(s.seq, seq);
+    }
+
+    // Weighted average of all samples; 0 if there are none.
+    double get(clock::time_point now = clock::now()) const
+    {
+        int64_t t = ticks(now);
+        double sum = 0, weight = 0;
+        slots_.for_each([&](const slot& s) {
+            double sum_s, weight_s;
+            int64_t last;
+            moments_impl::read_consistent(s, [&](const slot& c) {
+                sum_s = c.sum.load(std::memory_order_relaxed);
+                weight_s = c.weight.load(std::memory_order_relaxed);
+                last = c.last.load(std::memory_order_relaxed);
+            });
+            double decay = t > last ? std::exp(-rate_ * (t - last)) : 1.0;
+            sum += sum_s * decay;
+            weight += weight_s * decay;
+        });
+        return weight > 0 ? sum / weight : 0.0;
+    }
+
+  private:
+    // Decay per clock tick.
+    static double check(clock::duration half_life)
+    {
+        if (half_life.count() <= 0) {
+            throw std::invalid_argument("ewma: half life must be positive");
+        }
+        return std::log(2.0) / static_cast<double>(half_life.count());
+    }
+
+    int64_t ticks(clock::time_point now) const noexcept
+    {
+        return static_cast<int64_t>((now - start_).count());
+    }
+
+    double rate_;
+    clock::time_point start_;
+    mutable thread_slots<slot> slots_;
+};
+
+// Per-sample EWMA `v += (x - v) / 2^Shift` in fixed point (`Frac`
+// fractional bits) on a single `aligned_atomic<int64_t>`, updated with a CAS
+// loop. Cheaper to read and smaller than `ewma`, for values that are updated
+// at low rates or by few threads. The first sample initializes the average.
+template<unsigned Shift = 4, unsigned Frac = 16, size_t Align = 64>
+class atomic_ewma
+{
+    static_assert(Shift > 0 && Shift < 32, "Shift must be in [1, 31].");
+    static_assert(Frac < 48, "Frac must be below 48.");
+
+  public:
+    atomic_ewma() = default;
+    atomic_ewma(const atomic_ewma&) = delete;
+    atomic_ewma& operator=(const atomic_ewma&) = delete;
+
+    void add(double x) noexcept
+    {
+        int64_t sample = static_cast<int64_t>(std::llround(x * scale));
+        int64_t v = value_.load(std::memory_order_relaxed);
+        while (!value_.compare_exchange_weak(
+          v,
+          v == empty ? sample : v + (sample - v) / (int64_t(1) << Shift),
+          std::memory_order_relaxed)) {
+        }
+    }
+
+    // Current average; 0 before the first sample.
+    double get() const noexcept
+    {
+        int64_t v = value_.load(std::memory_order_relaxed);
+        return v == empty ? 0.0 : static_cast<double>(v) / scale;
+    }
+
+  private:
+    static constexpr double scale = static_cast<double>(uint64_t(1) << Frac);
+    static constexpr int64_t empty = std::numeric_limits<int64_t>::min();
+
+    aligned_atomic<int64_t, Align> value_{ empty };
+};
+
+template<unsigned Shift, unsigned Frac, size_t Align>
+constexpr double atomic_ewma<Shift, Frac, Align>::scale;
+
+template<unsigned Shift, unsigned Frac, size_t Align>
+constexpr int64_t atomic_ewma<Shift, Frac, Align>::empty;
@@ -0,0 +1,126 @@
+// Copyright (c) 2021 Thomas Nagler
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "aligned_atomic.hpp"
+
+#include <cstddef>     // size_t
+#include <limits>      // std::numeric_limits
+#include <type_traits> // std::is_base_of
+
+// Base class of elements of an `mpsc_queue`.
+struct mpsc_node
+{
+    std::atomic<mpsc_node*> next{ nullptr };
+};
+
+// Intrusive multi-producer, single-consumer queue after Vyukov. Elements
+// derive from `mpsc_node` and are linked in place, so the queue never
+// allocates. A push is one `exchange()` on the tail and a store; a pop only
+// loads and stores, except when it takes the last element (one `exchange()`
+// to re-insert the stub node). The tail, written by producers, and the head,
+// owned by the consumer, are on separate lines.
+//
+// A producer that is preempted between its two steps briefly hides the
+// elements pushed after it: `pop()` returns `nullptr` until it resumes.
+// Elements must stay alive until popped.
+template<class Node = mpsc_node, size_t Align = 64>
+class mpsc_queue
+{
+    static_assert(std::is_base_of<mpsc_node, Node>::value,
+                  "Node must derive from mpsc_node.");
+
+  public:
+    mpsc_queue() noexcept
+      : tail_(&stub_)
+      , head_(&stub_)
+    {}
+
+    mpsc_queue(const mpsc_queue&) = delete;
+    mpsc_queue& operator=(const mpsc_queue&) = delete;
+
+    // Any thread.
+    void push(Node* node) noexcept { push_node(node); }
+
+    // Consumer only. Oldest element, or `nullptr` if the queue is empty.
+    Node* pop() noexcept
+    {
+        mpsc_node* head = head_;
+        mpsc_node* next = head->next.load(std::memory_order_acquire);
+        if (head == &stub_) {
+            if (next == nullptr) {
+                return nullptr;
+            }
+            head_ = head = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next != nullptr) {
+            head_ = next;
+            return static_cast<Node*>(head);
+        }
+        if (head != tail_.load(std::memory_order_acquire)) {
+            return nullptr; // a push is in progress
+        }
+        // `head` is the last element; put the stub behind it.
+        push_node(&stub_);
+        next = head->next.load(std::memory_order_acquire);
+        if (next != nullptr) {
+            head_ = next;
+            return static_cast<Node*>(head);
+        }
+        return nullptr;
+    }
+
+    // Consumer only. Pops up to `max` elements and calls `f(Node*)` on each;
+    // returns the number of elements popped.
+    template<class F>
+    size_t drain(F f, size_t max = std::numeric_limits<size_t>::max())
+    {
+        size_t n = 0;
+        for (; n < max; ++n) {
+            Node* node = pop();
+            if (node == nullptr) {
+                break;
+            }
+            f(node);
+        }
+        return n;
+    }
+
+    // Consumer only. Whether the queue is empty, ignoring pushes that are
+    // still in progress.
+    bool empty() const noexcept
+    {
+        return head_ == &stub_ &&
+               stub_.next.load(std::memory_order_acquire) == nullptr;
+    }
+
+  private:
+    void push_node(mpsc_node* node) noexcept
+    {
+        node->next.store(nullptr, std::memory_order_relaxed);
+        mpsc_node* prev = tail_.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    aligned_atomic<mpsc_node*, Align> tail_;
+
+    // Consumer side.
+    alignas(Align) mpsc_node* head_;
+    mpsc_node stub_;
+};
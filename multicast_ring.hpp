@@ -0,0 +1,146 @@
+// Copyright (c) 2021 Thomas Nagler
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "aligned_atomic.hpp"
+
+#include <cstdint>   // int64_t
+#include <limits>    // std::numeric_limits
+#include <stdexcept> // std::invalid_argument
+
+// Single-producer, multi-consumer ring after the LMAX Disruptor: every
+// consumer sees every element. Each consumer advances its own cursor, an
+// `aligned_atomic<int64_t>` on a line of its own; the producer only
+// overwrites a slot once the slowest consumer has passed it. Elements are
+// read in place, so fan-out costs no copies.
+//
+// The producer caches the minimum of the consumer cursors and each consumer
+// caches the producer's cursor; both are refreshed only when the ring looks
+// full or empty.
+template<class T, size_t Align = 64>
+class multicast_ring
+{
+  public:
+    // `capacity` must be a power of two.
+    multicast_ring(size_t capacity, size_t num_consumers)
+      : slots_(check_capacity(capacity))
+      , consumers_(num_consumers)
+      , mask_(static_cast<int64_t>(capacity) - 1)
+    {}
+
+    multicast_ring(const multicast_ring&) = delete;
+    multicast_ring& operator=(const multicast_ring&) = delete;
+
+    // Producer: slot for the next element, or `nullptr` if the slowest
+    // consumer is a full ring behind. The element becomes visible to the
+    // consumers with `publish()`.
+    T* try_claim() noexcept
+    {
+        if (next_ - gate_cache_ > mask_) {
+            gate_cache_ = min_cursor();
+            if (next_ - gate_cache_ > mask_) {
+                return nullptr;
+            }
+        }
+        return &slots_[next_ & mask_];
+    }
+
+    void publish() noexcept
+    {
+        published_.store(++next_, std::memory_order_release);
+    }
+
+    // Producer: copies `value` into the ring. Returns false if full.
+    bool try_push(const T& value)
+    {
+        T* p = try_claim();
+        if (p == nullptr) {
+            return false;
+        }
+        *p = value;
+        publish();
+        return true;
+    }
+
+    // Consumer `c`: calls `f(const T&)` on up to `max` elements it hasn't
+    // seen yet, then releases them in one step. Returns the number of
+    // elements read.
+    template<class F>
+    size_t poll(size_t c, F f, size_t max = std::numeric_limits<size_t>::max())
+    {
+        consumer& self = consumers_[c];
+        int64_t cursor = self.cursor.load(std::memory_order_relaxed);
+        if (cursor == self.published_cache) {
+            self.published_cache = published_.load(std::memory_order_acquire);
+        }
+        int64_t end = self.published_cache;
+        if (static_cast<uint64_t>(end - cursor) > max) {
+            end = cursor + static_cast<int64_t>(max);
+        }
+        for (int64_t i = cursor; i < end; ++i) {
+            f(static_cast<const T&>(slots_[i & mask_]));
+        }
+        self.cursor.store(end, std::memory_order_release);
+        return static_cast<size_t>(end - cursor);
+    }
+
+    // Number of elements consumer `c` has read.
+    int64_t cursor(size_t c) const noexcept
+    {
+        return consumers_[c].cursor.load(std::memory_order_acquire);
+    }
+
+    size_t capacity() const noexcept { return slots_.size(); }
+    size_t num_consumers() const noexcept { return consumers_.size(); }
+
+  private:
+    // The cached producer cursor is only touched by the consumer itself.
+    struct consumer
+    {
+        aligned_atomic<int64_t, Align> cursor{ 0 };
+        int64_t published_cache{ 0 };
+    };
+
+    static size_t check_capacity(size_t capacity)
+    {
+        if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+            throw std::invalid_argument(
+              "multicast_ring: capacity must be a power of two");
+        }
+        return capacity;
+    }
+
+    int64_t min_cursor() const noexcept
+    {
+        int64_t min = next_;
+        for (const auto& c : consumers_) {
+            int64_t cursor = c.cursor.load(std::memory_order_acquire);
+            min = cursor < min ? cursor : min;
+        }
+        return min;
+    }
+
+    alloc_impl::aligned_array<T> slots_;
+    alloc_impl::aligned_array<consumer> consumers_;
+    int64_t mask_;
+
+    // Producer side.
+    aligned_atomic<int64_t, Align> published_{ 0 };
+    int64_t next_{ 0 };
+    int64_t gate_cache_{ 0 };
+};
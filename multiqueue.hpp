@@ -0,0 +1,196 @@
+// Copyright (c) 2021 Thomas Nagler
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "aligned_atomic.hpp"
+#include "hash_mix.hpp"
+
+#include <algorithm>   // std::push_heap, std::pop_heap
+#include <cstdint>     // uint64_t, uintptr_t
+#include <limits>      // std::numeric_limits
+#include <stdexcept>   // std::invalid_argument
+#include <thread>      // std::thread::hardware_concurrency
+#include <type_traits> // std::is_integral
+#include <utility>     // std::pair, std::move
+#include <vector>      // std::vector
+
+namespace multiqueue_impl {
+
+// Per-thread random numbers for picking queues.
+inline uint64_t
+next_random() noexcept
+{
+    static thread_local uint64_t x = 0;
+    if (x == 0) {
+        x = hash_impl::mix64(reinterpret_cast<uintptr_t>(&x)) | 1;
+    }
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x;
+}
+
+inline size_t
+default_queues() noexcept
+{
+    size_t threads = std::thread::hardware_concurrency();
+    return 2 * (threads > 0 ? threads : 1);
+}
+
+} // end namespace multiqueue_impl
+
+// Relaxed concurrent priority queue (MultiQueue, Rihani, Sanders, and
+// Dementiev, 2015): a set of sequential min-heaps, each behind a try-lock.
+// `push()` inserts into a random heap; `pop()` looks at two random heaps and
+// takes from the one with the smaller top. `pop()` therefore returns one of
+// the smallest elements, not necessarily the smallest; the expected rank
+// error grows linearly with the number of heaps.
+//
+// Each heap's lock and a cached copy of its top priority share a line of
+// their own, so choosing between two heaps reads two lines and never locks.
+template<class T, class Priority = uint64_t, size_t Align = 64>
+class multiqueue
+{
+    static_assert(std::is_integral<Priority>::value,
+                  "Priority must be an integral type.");
+
+  public:
+    // `num_queues` defaults to twice the number of hardware threads.
+    explicit multiqueue(size_t num_queues = multiqueue_impl::default_queues())
+      : queues_(num_queues > 1 ? num_queues : 2)
+    {}
+
+    multiqueue(const multiqueue&) = delete;
+    multiqueue& operator=(const multiqueue&) = delete;
+
+    // Inserts `value` with priority `priority` (smaller comes first). The
+    // largest value of `Priority` is reserved; pushing it throws
+    // `std::invalid_argument`.
+    void push(Priority priority, T value)
+    {
+        if (priority == none) {
+            throw std::invalid_argument(
+              "multiqueue: the largest priority is reserved");
+        }
+        while (true) {
+            queue& q = queues_[multiqueue_impl::next_random() % queues_.size()];
+            if (!q.try_lock()) {
+                continue;
+            }
+            try {
+                q.heap.emplace_back(priority, std::move(value));
+            } catch (...) {
+                q.unlock();
+                throw;
+            }
+            std::push_heap(q.heap.begin(), q.heap.end(), later);
+            q.update_top();
+            q.unlock();
+            return;
+        }
+    }
+
+    // Removes one of the elements with the smallest priorities. Returns
+    // false if all heaps were found empty.
+    bool pop(Priority& priority, T& value)
+    {
+        while (true) {
+            size_t i = multiqueue_impl::next_random() % queues_.size();
+            size_t j = multiqueue_impl::next_random() % queues_.size();
+            Priority ti = queues_[i].top.load(std::memory_order_relaxed);
+            Priority tj = queues_[j].top.load(std::memory_order_relaxed);
+            queue& q = queues_[tj < ti ? j : i];
+            if ((tj < ti ? tj : ti) == none) {
+                if (all_empty()) {
+                    return false;
+                }
+                continue;
+            }
+            if (!q.try_lock()) {
+                continue;
+            }
+            if (q.heap.empty()) {
+                q.unlock();
+                continue;
+            }
+            std::pop_heap(q.heap.begin(), q.heap.end(), later);
+            priority = q.heap.back().first;
+            value = std::move(q.heap.back().second);
+            q.heap.pop_back();
+            q.update_top();
+            q.unlock();
+            return true;
+        }
+    }
+
+    // Whether all heaps look empty.
+    bool empty() const noexcept { return all_empty(); }
+
+    size_t num_queues() const noexcept { return queues_.size(); }
+
+  private:
+    using entry = std::pair<Priority, T>;
+
+    static constexpr Priority none = std::numeric_limits<Priority>::max();
+
+    static bool later(const entry& a, const entry& b) noexcept
+    {
+        return a.first > b.first;
+    }
+
+    // The lock and the cached top share the first line; the heap's vector
+    // header, written on every push and pop, starts on the next one.
+    struct alignas(Align) queue
+    {
+        std::atomic<bool> locked{ false };
+        std::atomic<Priority> top{ none };
+        alignas(Align) std::vector<entry> heap;
+
+        bool try_lock() noexcept
+        {
+            return !locked.load(std::memory_order_relaxed) &&
+                   !locked.exchange(true, std::memory_order_acquire);
+        }
+
+        void unlock() noexcept
+        {
+            locked.store(false, std::memory_order_release);
+        }
+
+        void update_top() noexcept
+        {
+            top.store(heap.empty() ? none : heap.front().first,
+                      std::memory_order_relaxed);
+        }
+    };
+
+    bool all_empty() const noexcept
+    {
+        for (const auto& q : queues_) {
+            if (q.top.load(std::memory_order_relaxed) != none) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    alloc_impl::aligned_array<queue> queues_;
+};
+
+template<class T, class Priority, size_t Align>
+constexpr Priority multiqueue<T, Priority, Align>::none;
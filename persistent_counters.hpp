@@ -0,0 +1,255 @@
+// Copyright (c) 2021 Thomas Nagler
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "aligned_atomic.hpp"
+#include "mapped_region.hpp"
+
+#include <cerrno>             // errno
+#include <chrono>             // std::chrono::milliseconds
+#include <condition_variable> // std::condition_variable
+#include <cstddef>            // offsetof
+#include <cstdint>            // uint32_t, uint64_t
+#include <cstring>            // std::memcpy
+#include <mutex>              // std::mutex, std::unique_lock
+#include <stdexcept>          // std::runtime_error
+#include <string>             // std::string
+#include <thread>             // std::thread
+
+#include <fcntl.h>    // open, O_* constants
+#include <sys/stat.h> // fstat
+#include <unistd.h>   // close, ftruncate, pread
+
+namespace persistent_counters_impl {
+
+constexpr uint64_t magic = 0x52544e4354414c41; // "ALATCNTR"
+constexpr uint32_t version = 1;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+              "64-bit atomics must be lock-free to live in a file mapping.");
+
+// First line of the file. `generation` counts completed checkpoints; `clean`
+// is set when the file is closed properly and cleared while it is in use.
+struct alignas(64) header
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t align;
+    uint64_t count;
+    uint64_t slot_size;
+    std::atomic<uint64_t> generation;
+    std::atomic<uint32_t> clean;
+};
+
+} // end namespace persistent_counters_impl
+
+// Fixed-size array of `aligned_atomic<uint64_t>` counters backed by a file
+// via `mmap(MAP_SHARED)`. Updates go straight to the page cache, so counters
+// survive process restarts (and crashes) with no serialization step.
+// Checkpoints `msync()` the file to make the values durable against system
+// crashes; they run on demand and, optionally, periodically from a
+// background thread.
+//
+// Every counter is updated atomically on its own, but a checkpoint is not a
+// consistent snapshot across counters.
+template<size_t Align = 64>
+class persistent_counters
+{
+    static_assert(Align >= 8 && (Align & (Align - 1)) == 0,
+                  "Align must be a power of two of at least 8 bytes.");
+
+  public:
+    using counter_type = aligned_atomic<uint64_t, Align>;
+
+    // Opens `path`, creating it if necessary. Only an empty file is
+    // initialized; a non-empty file must have been created with the same
+    // `count` and `Align`, otherwise `std::runtime_error` is thrown and the
+    // file is left untouched. A positive `checkpoint_interval` starts a
+    // background thread that checkpoints at that rate.
+    persistent_counters(const std::string& path,
+                        size_t count,
+                        std::chrono::milliseconds checkpoint_interval =
+                          std::chrono::milliseconds(0))
+    {
+        using namespace persistent_counters_impl;
+        bool fresh = false;
+        region_ = open(path, count, fresh);
+        if (fresh) {
+            header* h = head();
+            h->version = version;
+            h->align = Align;
+            h->count = count;
+            h->slot_size = sizeof(counter_type);
+            h->generation.store(0);
+            h->clean.store(1);
+            for (size_t i = 0; i < count; ++i) {
+                ::new (static_cast<void*>(slots() + i)) counter_type(0);
+            }
+            h->magic = magic;
+            region_.sync();
+        }
+        recovered_ = head()->clean.exchange(0) == 0;
+
+        if (checkpoint_interval.count() > 0) {
+            checkpointer_ = std::thread([this, checkpoint_interval] {
+                std::unique_lock<std::mutex> lk(mtx_);
+                while (!cv_.wait_for(
+                  lk, checkpoint_interval, [this] { return stop_; })) {
+                    try {
+                        checkpoint();
+                    } catch (...) {
+                        // Retried at the next interval.
+                    }
+                }
+            });
+        }
+    }
+
+    persistent_counters(const persistent_counters&) = delete;
+    persistent_counters& operator=(const persistent_counters&) = delete;
+
+    // Stops the background thread, checkpoints, and marks the file clean.
+    ~persistent_counters()
+    {
+        if (checkpointer_.joinable()) {
+            {
+                std::lock_guard<std::mutex> lk(mtx_);
+                stop_ = true;
+            }
+            cv_.notify_one();
+            checkpointer_.join();
+        }
+        try {
+            checkpoint();
+            head()->clean.store(1);
+            region_.sync();
+        } catch (...) {
+            // Nothing we can do; the file is left marked as not clean.
+        }
+    }
+
+    counter_type& operator[](size_t i) noexcept { return slots()[i]; }
+    const counter_type& operator[](size_t i) const noexcept
+    {
+        return slots()[i];
+    }
+
+    size_t size() const noexcept { return head()->count; }
+
+    // Writes all counters to disk and, once that succeeded, increments the
+    // checkpoint generation. Throws `std::system_error` if `msync()` fails.
+    void checkpoint()
+    {
+        region_.sync();
+        head()->generation.fetch_add(1);
+        region_.sync();
+    }
+
+    // Number of checkpoints completed over the lifetime of the file.
+    uint64_t generation() const noexcept { return head()->generation.load(); }
+
+    // Whether the previous user of the file did not close it properly. Values
+    // then reflect the last update that reached the page cache (after a
+    // process crash) or at least the last checkpoint (after a system crash).
+    bool recovered() const noexcept { return recovered_; }
+
+  private:
+    static constexpr size_t first_slot =
+      sizeof(persistent_counters_impl::header) > Align
+        ? sizeof(persistent_counters_impl::header)
+        : Align;
+
+    static size_t bytes(size_t count) noexcept
+    {
+        return first_slot + count * sizeof(counter_type);
+    }
+
+    // Opens or creates `path` and maps it. An empty file is grown to its
+    // full size (`fresh`); the header of any other file is checked with
+    // `pread()` before the file is mapped, so that a layout mismatch never
+    // modifies it.
+    static mapped_region open(const std::string& path,
+                              size_t count,
+                              bool& fresh)
+    {
+        using namespace persistent_counters_impl;
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            mapping_impl::throw_errno("open");
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            int err = errno;
+            ::close(fd);
+            mapping_impl::throw_errno("fstat", err);
+        }
+        fresh = st.st_size == 0;
+        if (fresh) {
+            if (ftruncate(fd, static_cast<off_t>(bytes(count))) != 0) {
+                int err = errno;
+                ::close(fd);
+                mapping_impl::throw_errno("ftruncate", err);
+            }
+        } else if (static_cast<size_t>(st.st_size) < bytes(count) ||
+                   !matches(fd, count)) {
+            ::close(fd);
+            throw std::runtime_error("persistent_counters: " + path +
+                                     " has an incompatible layout");
+        }
+        return mapped_region(fd, mapped_region::access::read_write);
+    }
+
+    // Whether the header in `fd` describes this layout.
+    static bool matches(int fd, size_t count) noexcept
+    {
+        using namespace persistent_counters_impl;
+        char buf[sizeof(header)];
+        if (::pread(fd, buf, sizeof(buf), 0) !=
+            static_cast<ssize_t>(sizeof(buf))) {
+            return false;
+        }
+        uint64_t m, n, slot_size;
+        uint32_t v, a;
+        std::memcpy(&m, buf + offsetof(header, magic), sizeof(m));
+        std::memcpy(&v, buf + offsetof(header, version), sizeof(v));
+        std::memcpy(&a, buf + offsetof(header, align), sizeof(a));
+        std::memcpy(&n, buf + offsetof(header, count), sizeof(n));
+        std::memcpy(
+          &slot_size, buf + offsetof(header, slot_size), sizeof(slot_size));
+        return m == magic && v == version && a == Align && n == count &&
+               slot_size == sizeof(counter_type);
+    }
+
+    persistent_counters_impl::header* head() const noexcept
+    {
+        return static_cast<persistent_counters_impl::header*>(region_.data());
+    }
+
+    counter_type* slots() const noexcept
+    {
+        return reinterpret_cast<counter_type*>(
+          static_cast<char*>(region_.data()) + first_slot);
+    }
+
+    mapped_region region_;
+    bool recovered_{ false };
+    std::thread checkpointer_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    bool stop_{ false };
+};
@@ -0,0 +1,253 @@
+// Copyright (c) 2021 Thomas Nagler
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "aligned_atomic.hpp"
+#include "thread_registry.hpp"
+
+#include <cmath>     // std::ceil, std::log, std::pow
+#include <cstdint>   // uint64_t
+#include <new>       // std::bad_alloc
+#include <stdexcept> // std::invalid_argument
+#include <vector>    // std::vector
+
+namespace quantile_impl {
+
+// Counters written by a single thread: relaxed loads and stores suffice
+// and compile to plain moves.
+inline void
+bump(std::atomic<uint64_t>& counter) noexcept
+{
+    counter.store(counter.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_relaxed);
+}
+
+struct shard_header
+{
+    std::atomic<uint64_t> zeros;
+};
+
+// One thread's sketch: a header line followed by lines of bucket counters.
+template<size_t Align>
+struct alignas(Align) shard
+  : shard_header
+  , private padding_impl::padding<sizeof(shard_header), Align>
+{
+    static constexpr size_t per_line = Align / sizeof(uint64_t);
+
+    struct alignas(Align) line
+    {
+        std::atomic<uint64_t> counts[per_line];
+    };
+
+    explicit shard(size_t num_buckets)
+      : lines(num_buckets / per_line + 1)
+    {
+        zeros.store(0, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t>& bucket(size_t i) noexcept
+    {
+        return lines[i / per_line].counts[i % per_line];
+    }
+
+    static void* operator new(size_t count)
+    {
+        void* p = alloc_impl::aligned_malloc(count, alignof(shard));
+        if (p == nullptr) {
+            throw std::bad_alloc();
+        }
+        return p;
+    }
+
+    static void operator delete(void* ptr) { alloc_impl::aligned_free(ptr); }
+
+    alloc_impl::aligned_array<line> lines;
+};
+
+} // end namespace quantile_impl
+
+// Quantile sketch with relative-error guarantees (DDSketch, Masson, Rim,
+// and Lee, 2019). Values are counted in logarithmic buckets: every quantile
+// of values in `[min_value, max_value]` is returned with a relative error of
+// at most `relative_accuracy`. Smaller values (including zero and negative
+// values) are counted as zero, larger ones as `max_value`.
+//
+// Every thread records into a sketch of its own, laid out on separate cache
+// lines, with plain stores and no locks. Queries merge all shards. Memory
+// per thread is bounded by `max_buckets` counters; if the value range needs
+// more, the lowest buckets are collapsed into one, so the guarantee only
+// holds for the upper part of the range (`num_buckets()` buckets below
+// `max_value`).
+template<size_t Align = 64>
+class quantile_sketch
+{
+    using shard = quantile_impl::shard<Align>;
+
+  public:
+    explicit quantile_sketch(double relative_accuracy = 0.01,
+                             double min_value = 1e-9,
+                             double max_value = 1e9,
+                             size_t max_buckets = 4096)
+      : gamma_(check(relative_accuracy, min_value, max_value, max_buckets))
+      , log_gamma_(std::log(gamma_))
+      , min_value_(min_value)
+    {
+        long lo = index(min_value);
+        long hi = index(max_value);
+        long n = hi - lo + 1;
+        if (n > static_cast<long>(max_buckets)) {
+            lo = hi - static_cast<long>(max_buckets) + 1;
+            n = static_cast<long>(max_buckets);
+        }
+        offset_ = lo;
+        num_buckets_ = static_cast<size_t>(n);
+    }
+
+    quantile_sketch(const quantile_sketch&) = delete;
+    quantile_sketch& operator=(const quantile_sketch&) = delete;
+
+    ~quantile_sketch()
+    {
+        shards_.for_each([](std::atomic<shard*>& s) { delete s.load(); });
+    }
+
+    // Adds `value` to the calling thread's shard.
+    void record(double value)
+    {
+        shard& s = local();
+        if (!(value >= min_value_)) {
+            quantile_impl::bump(s.zeros);
+            return;
+        }
+        long i = index(value) - offset_;
+        i = i < 0 ? 0 : i;
+        i = i < static_cast<long>(num_buckets_)
+              ? i
+              : static_cast<long>(num_buckets_) - 1;
+        quantile_impl::bump(s.bucket(static_cast<size_t>(i)));
+    }
+
+    // Estimates of the quantiles `qs` (each in [0, 1]), from one merge of
+    // all shards. Returns zeros if nothing was recorded.
+    std::vector<double> quantiles(const std::vector<double>& qs) const
+    {
+        uint64_t zeros = 0;
+        std::vector<uint64_t> counts(num_buckets_);
+        shards_.for_each([&](std::atomic<shard*>& slot) {
+            shard* s = slot.load(std::memory_order_acquire);
+            if (s == nullptr) {
+                return;
+            }
+            zeros += s->zeros.load(std::memory_order_relaxed);
+            for (size_t i = 0; i < num_buckets_; ++i) {
+                counts[i] += s->bucket(i).load(std::memory_order_relaxed);
+            }
+        });
+        uint64_t total = zeros;
+        for (uint64_t c : counts) {
+            total += c;
+        }
+
+        std::vector<double> result(qs.size(), 0.0);
+        if (total == 0) {
+            return result;
+        }
+        for (size_t k = 0; k < qs.size(); ++k) {
+            double rank = qs[k] * static_cast<double>(total - 1);
+            uint64_t seen = zeros;
+            if (rank < static_cast<double>(seen)) {
+                continue; // a zero
+            }
+            size_t i = 0;
+            while (i + 1 < num_buckets_ &&
+                   static_cast<double>(seen + counts[i]) <= rank) {
+                seen += counts[i++];
+            }
+            result[k] = value(static_cast<long>(i) + offset_);
+        }
+        return result;
+    }
+
+    double quantile(double q) const
+    {
+        return quantiles(std::vector<double>(1, q))[0];
+    }
+
+    // Number of recorded values.
+    uint64_t count() const
+    {
+        uint64_t n = 0;
+        shards_.for_each([&](std::atomic<shard*>& slot) {
+            shard* s = slot.load(std::memory_order_acquire);
+            if (s == nullptr) {
+                return;
+            }
+            n += s->zeros.load(std::memory_order_relaxed);
+            for (size_t i = 0; i < num_buckets_; ++i) {
+                n += s->bucket(i).load(std::memory_order_relaxed);
+            }
+        });
+        return n;
+    }
+
+    size_t num_buckets() const noexcept { return num_buckets_; }
+
+  private:
+    static double check(double relative_accuracy,
+                        double min_value,
+                        double max_value,
+                        size_t max_buckets)
+    {
+        if (!(relative_accuracy > 0 && relative_accuracy < 1) ||
+            !(min_value > 0 && min_value < max_value) || max_buckets == 0) {
+            throw std::invalid_argument("quantile_sketch: invalid parameters");
+        }
+        return (1 + relative_accuracy) / (1 - relative_accuracy);
+    }
+
+    long index(double value) const noexcept
+    {
+        return static_cast<long>(std::ceil(std::log(value) / log_gamma_));
+    }
+
+    // Representative of bucket `i`, within the relative accuracy of all
+    // values in it.
+    double value(long i) const noexcept
+    {
+        return 2 * std::pow(gamma_, static_cast<double>(i)) / (gamma_ + 1);
+    }
+
+    shard& local()
+    {
+        std::atomic<shard*>& slot = shards_.local();
+        shard* s = slot.load(std::memory_order_relaxed);
+        if (s == nullptr) {
+            s = new shard(num_buckets_);
+            slot.store(s, std::memory_order_release);
+        }
+        return *s;
+    }
+
+    double gamma_;
+    double log_gamma_;
+    double min_value_;
+    long offset_;
+    size_t num_buckets_;
+    mutable thread_slots<std::atomic<shard*>> shards_;
+};
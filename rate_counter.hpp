@@ -0,0 +1,183 @@
+// Copyright (c) 2021 Thomas Nagler
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "aligned_atomic.hpp"
+#include "thread_registry.hpp"
+
+#include <chrono>    // std::chrono::steady_clock
+#include <cstdint>   // uint32_t, uint64_t
+#include <stdexcept> // std::invalid_argument
+#include <thread>    // std::thread::hardware_concurrency
+
+// Event counter over a sliding time window (e.g., requests per second over
+// the last 1, 10, or 60 seconds). Time is divided into buckets of length
+// `resolution`, kept in a ring; every bucket is split into shards on
+// separate lines, and threads add to the shard of their thread index.
+//
+// Each shard is one 64-bit word holding the bucket's epoch (upper half) and
+// count (lower half). Every update is a CAS on the whole word that checks
+// the epoch: a thread that finds a shard from an earlier lap of the ring
+// resets it, so buckets are rotated lazily and no count is ever lost to a
+// concurrent reset or credited to the wrong lap. Buckets never rotate
+// backwards: events older than the ring (e.g., from a thread that was
+// preempted for a whole lap) are dropped. Counts per bucket and shard must
+// stay below 2^32.
+template<size_t Align = 64>
+class rate_counter
+{
+  public:
+    using clock = std::chrono::steady_clock;
+
+    // Windows up to `max_window` can be queried; longer ones are clamped.
+    // `num_shards == 0` uses one shard per hardware thread.
+    explicit rate_counter(
+      clock::duration max_window = std::chrono::seconds(60),
+      clock::duration resolution = std::chrono::seconds(1),
+      size_t num_shards = 0)
+      : resolution_(check(max_window, resolution))
+      , num_buckets_(static_cast<size_t>(max_window / resolution) + 1)
+      , num_shards_(num_shards > 0 ? num_shards : default_shards())
+      , start_(clock::now())
+      , slots_(num_buckets_ * num_shards_)
+    {}
+
+    rate_counter(const rate_counter&) = delete;
+    rate_counter& operator=(const rate_counter&) = delete;
+
+    void add(uint64_t n = 1, clock::time_point now = clock::now())
+    {
+        uint64_t e = epoch(now);
+        size_t shard = thread_registry::index() % num_shards_;
+        auto& slot = slots_[(e % num_buckets_) * num_shards_ + shard];
+        uint64_t w = slot.load(std::memory_order_relaxed);
+        while (true) {
+            uint64_t desired;
+            if (epoch_of(w) == tag(e)) {
+                desired = w + n;
+            } else if (older(epoch_of(w), e)) {
+                desired = pack(e, n);
+            } else {
+                return; // bucket already reused for a later lap; too old
+            }
+            if (slot.compare_exchange_weak(
+                  w, desired, std::memory_order_relaxed)) {
+                return;
+            }
+        }
+    }
+
+    // Number of events in the current bucket and the ones before it that
+    // span `window` (rounded up to whole buckets).
+    uint64_t count(clock::duration window,
+                   clock::time_point now = clock::now()) const noexcept
+    {
+        uint64_t e = epoch(now);
+        uint64_t k = buckets_in(window);
+        return sum(e + 1 > k ? e + 1 - k : 0, e);
+    }
+
+    // Events per second over the `window` that ends with the last complete
+    // bucket. Excludes the current bucket, so the rate doesn't dip at the
+    // start of each bucket.
+    double rate(clock::duration window,
+                clock::time_point now = clock::now()) const noexcept
+    {
+        uint64_t e = epoch(now);
+        uint64_t k = buckets_in(window);
+        if (k > e) {
+            k = e; // no complete buckets before the start
+        }
+        if (k == 0) {
+            return 0;
+        }
+        double seconds =
+          std::chrono::duration<double>(resolution_).count() * k;
+        return static_cast<double>(sum(e - k, e - 1)) / seconds;
+    }
+
+  private:
+    static clock::duration check(clock::duration max_window,
+                                 clock::duration resolution)
+    {
+        if (resolution.count() <= 0 || max_window < resolution) {
+            throw std::invalid_argument("rate_counter: invalid window");
+        }
+        return resolution;
+    }
+
+    static size_t default_shards() noexcept
+    {
+        size_t n = std::thread::hardware_concurrency();
+        return n > 0 ? n : 1;
+    }
+
+    // Epochs are stored modulo 2^32; a bucket would have to stay untouched
+    // for 2^32 buckets to be mistaken for a current one.
+    static uint64_t tag(uint64_t epoch) noexcept { return epoch & 0xffffffff; }
+    static uint64_t epoch_of(uint64_t w) noexcept { return w >> 32; }
+    static uint64_t count_of(uint64_t w) noexcept { return w & 0xffffffff; }
+    static uint64_t pack(uint64_t epoch, uint64_t n) noexcept
+    {
+        return (tag(epoch) << 32) | n;
+    }
+
+    // Whether the stored epoch `stored` precedes `epoch` (modulo 2^32).
+    static bool older(uint64_t stored, uint64_t epoch) noexcept
+    {
+        return ((tag(epoch) - stored) & 0xffffffff) - 1 < 0x7fffffff;
+    }
+
+    uint64_t epoch(clock::time_point now) const noexcept
+    {
+        return now < start_
+                 ? 0
+                 : static_cast<uint64_t>((now - start_) / resolution_);
+    }
+
+    uint64_t buckets_in(clock::duration window) const noexcept
+    {
+        uint64_t k = static_cast<uint64_t>(
+          (window + resolution_ - clock::duration(1)) / resolution_);
+        k = k > 0 ? k : 1;
+        return k < num_buckets_ ? k : num_buckets_ - 1;
+    }
+
+    // Sum over the buckets of epochs `[first, last]`, skipping buckets that
+    // haven't been rotated yet.
+    uint64_t sum(uint64_t first, uint64_t last) const noexcept
+    {
+        uint64_t total = 0;
+        for (uint64_t e = first; e <= last; ++e) {
+            for (size_t s = 0; s < num_shards_; ++s) {
+                uint64_t w = slots_[(e % num_buckets_) * num_shards_ + s].load(
+                  std::memory_order_relaxed);
+                if (epoch_of(w) == tag(e)) {
+                    total += count_of(w);
+                }
+            }
+        }
+        return total;
+    }
+
+    clock::duration resolution_;
+    size_t num_buckets_;
+    size_t num_shards_;
+    clock::time_point start_;
+    alloc_impl::aligned_array<aligned_atomic<uint64_t, Align>> slots_;
+};
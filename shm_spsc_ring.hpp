@@ -0,0 +1,239 @@
+// Copyright (c) 2021 Thomas Nagler
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "aligned_atomic.hpp"
+#include "mapped_region.hpp"
+
+#include <chrono>      // std::chrono::steady_clock
+#include <cstdint>     // uint32_t, uint64_t
+#include <stdexcept>   // std::invalid_argument, std::runtime_error
+#include <string>      // std::string
+#include <thread>      // std::this_thread::yield
+#include <type_traits> // std::is_trivially_copyable
+#include <utility>     // std::move
+
+namespace shm_spsc_impl {
+
+constexpr uint64_t magic = 0x474e495243505341; // "ASPCRING"
+constexpr uint32_t version = 1;
+
+// Initialization states of a ring segment. A fresh segment is zero-filled by
+// `ftruncate()`, hence `uninitialized == 0`.
+constexpr uint32_t uninitialized = 0;
+constexpr uint32_t initializing = 1;
+constexpr uint32_t ready = 2;
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+              "Atomics must be lock-free (and hence address-free) to be "
+              "shared between processes.");
+
+template<size_t Align>
+struct alignas(Align) control
+{
+    std::atomic<uint32_t> state;
+    uint32_t version;
+    uint64_t magic;
+    uint64_t capacity;
+    uint64_t element_size;
+    uint64_t element_align;
+};
+
+// Shared part of the ring. Producer and consumer indices are on separate
+// lines; the slots follow on the next line boundary.
+template<size_t Align>
+struct layout
+{
+    control<Align> ctrl;
+    aligned_atomic<uint64_t, Align> head; // next slot to read
+    aligned_atomic<uint64_t, Align> tail; // next slot to write
+};
+
+} // end namespace shm_spsc_impl
+
+// Single-producer, single-consumer ring buffer whose indices and storage live
+// in a POSIX shared memory object, so that producer and consumer can be
+// different processes. Elements are written and read in place; after setup,
+// neither side makes system calls.
+//
+// The first process to attach initializes the segment; others wait for that
+// to complete and check that element type and capacity agree. Each process
+// must use only the producer or only the consumer side of a ring.
+template<class T, size_t Align = 64>
+class shm_spsc_ring
+{
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "T must be trivially copyable to live in shared memory.");
+    static_assert(alignof(T) <= Align, "T must not be over-aligned.");
+
+  public:
+    // Attaches to the ring `name` (e.g. "/quotes"), creating it if necessary.
+    // `capacity` must be a power of two and the same in all processes.
+    // Throws `std::runtime_error` if the ring was created with a different
+    // layout or initialization doesn't complete within `timeout`.
+    static shm_spsc_ring open(
+      const std::string& name,
+      size_t capacity,
+      std::chrono::milliseconds timeout = std::chrono::milliseconds(1000))
+    {
+        if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+            throw std::invalid_argument(
+              "shm_spsc_ring: capacity must be a power of two");
+        }
+        return shm_spsc_ring(
+          mapped_region::create_shm(name, bytes(capacity), false),
+          capacity,
+          timeout);
+    }
+
+    // Removes the name of the ring. Attached processes are unaffected.
+    static void unlink(const std::string& name) noexcept
+    {
+        mapped_region::unlink_shm(name);
+    }
+
+    // Producer: slot for the next element, or `nullptr` if the ring is full.
+    // The element becomes visible to the consumer with `publish()`.
+    T* try_claim() noexcept
+    {
+        uint64_t tail = shared()->tail.load(std::memory_order_relaxed);
+        if (tail - head_cache_ == capacity_) {
+            head_cache_ = shared()->head.load(std::memory_order_acquire);
+            if (tail - head_cache_ == capacity_) {
+                return nullptr;
+            }
+        }
+        return slot(tail);
+    }
+
+    void publish() noexcept
+    {
+        uint64_t tail = shared()->tail.load(std::memory_order_relaxed);
+        shared()->tail.store(tail + 1, std::memory_order_release);
+    }
+
+    // Producer: copies `value` into the ring. Returns false if full.
+    bool try_push(const T& value) noexcept
+    {
+        T* p = try_claim();
+        if (p == nullptr) {
+            return false;
+        }
+        *p = value;
+        publish();
+        return true;
+    }
+
+    // Consumer: oldest element, or `nullptr` if the ring is empty. The slot
+    // is released to the producer with `consume()`.
+    const T* try_front() noexcept
+    {
+        uint64_t head = shared()->head.load(std::memory_order_relaxed);
+        if (head == tail_cache_) {
+            tail_cache_ = shared()->tail.load(std::memory_order_acquire);
+            if (head == tail_cache_) {
+                return nullptr;
+            }
+        }
+        return slot(head);
+    }
+
+    void consume() noexcept
+    {
+        uint64_t head = shared()->head.load(std::memory_order_relaxed);
+        shared()->head.store(head + 1, std::memory_order_release);
+    }
+
+    // Consumer: copies the oldest element to `value`. Returns false if empty.
+    bool try_pop(T& value) noexcept
+    {
+        const T* p = try_front();
+        if (p == nullptr) {
+            return false;
+        }
+        value = *p;
+        consume();
+        return true;
+    }
+
+    size_t capacity() const noexcept { return capacity_; }
+
+  private:
+    using layout = shm_spsc_impl::layout<Align>;
+
+    static size_t bytes(size_t capacity) noexcept
+    {
+        return sizeof(layout) + capacity * sizeof(T);
+    }
+
+    shm_spsc_ring(mapped_region region,
+                  size_t capacity,
+                  std::chrono::milliseconds timeout)
+      : region_(std::move(region))
+      , capacity_(capacity)
+    {
+        using namespace shm_spsc_impl;
+        auto& ctrl = shared()->ctrl;
+        uint32_t state = uninitialized;
+        if (ctrl.state.compare_exchange_strong(state, initializing)) {
+            ctrl.version = version;
+            ctrl.magic = magic;
+            ctrl.capacity = capacity;
+            ctrl.element_size = sizeof(T);
+            ctrl.element_align = alignof(T);
+            shared()->head.store(0, std::memory_order_relaxed);
+            shared()->tail.store(0, std::memory_order_relaxed);
+            ctrl.state.store(ready, std::memory_order_release);
+        } else {
+            auto deadline = std::chrono::steady_clock::now() + timeout;
+            while (ctrl.state.load(std::memory_order_acquire) != ready) {
+                if (std::chrono::steady_clock::now() > deadline) {
+                    throw std::runtime_error(
+                      "shm_spsc_ring: initialization timed out");
+                }
+                std::this_thread::yield();
+            }
+        }
+        if (ctrl.magic != magic || ctrl.version != version ||
+            ctrl.capacity != capacity || ctrl.element_size != sizeof(T) ||
+            ctrl.element_align != alignof(T)) {
+            throw std::runtime_error("shm_spsc_ring: incompatible layout");
+        }
+        head_cache_ = shared()->head.load(std::memory_order_acquire);
+        tail_cache_ = shared()->tail.load(std::memory_order_acquire);
+    }
+
+    layout* shared() const noexcept
+    {
+        return static_cast<layout*>(region_.data());
+    }
+
+    T* slot(uint64_t index) const noexcept
+    {
+        char* slots = static_cast<char*>(region_.data()) + sizeof(layout);
+        return reinterpret_cast<T*>(slots) + (index & (capacity_ - 1));
+    }
+
+    mapped_region region_;
+    size_t capacity_;
+
+    // Process-local copies of the other side's index; refreshed only when
+    // the ring looks full (producer) or empty (consumer).
+    uint64_t head_cache_;
+    uint64_t tail_cache_;
+};
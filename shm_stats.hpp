@@ -0,0 +1,360 @@
+// Copyright (c) 2021 Thomas Nagler
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "aligned_atomic.hpp"
+#include "mapped_region.hpp"
+
+#include <cstdint>   // uint32_t, uint64_t
+#include <cstring>   // std::strncpy, strnlen
+#include <limits>    // std::numeric_limits
+#include <memory>    // std::unique_ptr
+#include <mutex>     // std::mutex, std::lock_guard
+#include <stdexcept> // std::length_error, std::runtime_error
+#include <string>    // std::string
+#include <utility>   // std::move
+
+// Type tags stored in the segment header.
+enum class stat_type : uint32_t
+{
+    u64 = 1,
+    i64 = 2,
+    f64 = 3
+};
+
+// Layout of a statistics segment:
+//
+//   header | entry[capacity] | value lines
+//
+// The header and every entry occupy one 64 byte line; every value occupies
+// one line of `header::align` bytes at `entry::offset` from the start of the
+// segment. Entries are published by incrementing `header::count` (release),
+// so a reader only looks at entries below `count` (acquire).
+namespace shm_stats_impl {
+
+constexpr uint64_t magic = 0x5441545341544c41; // "ALATSTAT"
+constexpr uint32_t version = 1;
+constexpr size_t name_size = 48;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+              "64-bit atomics must be lock-free to be shared between "
+              "processes.");
+
+struct alignas(64) header
+{
+    std::atomic<uint64_t> magic;
+    uint32_t version;
+    uint32_t align;
+    uint32_t capacity;
+    uint32_t name_size;
+    uint64_t size;
+    std::atomic<uint32_t> count;
+};
+
+struct alignas(64) entry
+{
+    char name[name_size];
+    uint64_t offset;
+    stat_type type;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(header) == 64, "unexpected header size");
+static_assert(sizeof(entry) == 64, "unexpected entry size");
+
+template<class T>
+struct type_tag;
+
+template<>
+struct type_tag<uint64_t>
+{
+    static constexpr stat_type value = stat_type::u64;
+};
+
+template<>
+struct type_tag<int64_t>
+{
+    static constexpr stat_type value = stat_type::i64;
+};
+
+template<>
+struct type_tag<double>
+{
+    static constexpr stat_type value = stat_type::f64;
+};
+
+inline size_t
+segment_size(size_t capacity, size_t align)
+{
+    size_t table = sizeof(header) + capacity * sizeof(entry);
+    table = (table + align - 1) / align * align;
+    return table + capacity * align;
+}
+
+// Size of a new segment; the header stores the capacity in 32 bits.
+inline size_t
+checked_segment_size(size_t capacity, size_t align)
+{
+    if (capacity > std::numeric_limits<uint32_t>::max()) {
+        throw std::length_error("shm_stats_writer: capacity too large");
+    }
+    return segment_size(capacity, align);
+}
+
+} // end namespace shm_stats_impl
+
+// Writer side of a statistics segment. Counters are `aligned_atomic`s placed
+// directly in shared memory, so updating them costs exactly the same as
+// updating a private counter. Counters can be added at any time (up to the
+// capacity given at creation); readers pick them up on their next poll.
+template<size_t Align = 64>
+class shm_stats_writer
+{
+    static_assert(Align >= 8 && (Align & (Align - 1)) == 0,
+                  "Align must be a power of two of at least 8 bytes.");
+
+  public:
+    // Creates the POSIX shared memory object `name` (e.g., "/my_stats").
+    // If the name exists, throws `std::system_error` (`EEXIST`), unless
+    // `replace` is true: then the existing object is unlinked first. Only
+    // replace objects left behind by a crashed writer; a live writer keeps
+    // updating its (now unnamed) segment, which new readers no longer see.
+    // The name is removed when the writer is destroyed.
+    static shm_stats_writer create(const std::string& name,
+                                   size_t capacity,
+                                   bool replace = false)
+    {
+        size_t size = shm_stats_impl::checked_segment_size(capacity, Align);
+        if (replace) {
+            mapped_region::unlink_shm(name);
+        }
+        return shm_stats_writer(
+          mapped_region::create_shm(name, size), capacity, name);
+    }
+
+#if defined(__linux__)
+    // Creates an anonymous segment that readers open via `fd()`.
+    static shm_stats_writer create_anonymous(const std::string& name,
+                                             size_t capacity)
+    {
+        size_t size = shm_stats_impl::checked_segment_size(capacity, Align);
+        return shm_stats_writer(
+          mapped_region::create_memfd(name, size), capacity, "");
+    }
+#endif
+
+    shm_stats_writer(shm_stats_writer&& other) noexcept
+      : region_(std::move(other.region_))
+      , name_(std::move(other.name_))
+    {
+        other.name_.clear();
+    }
+
+    ~shm_stats_writer()
+    {
+        if (!name_.empty()) {
+            mapped_region::unlink_shm(name_);
+        }
+    }
+
+    // Adds a counter initialized to zero. `T` must be `uint64_t`, `int64_t`
+    // or `double`; names longer than 47 characters are truncated. Throws
+    // `std::length_error` if the segment is full.
+    template<class T>
+    aligned_atomic<T, Align>& add(const std::string& name)
+    {
+        using namespace shm_stats_impl;
+        std::lock_guard<std::mutex> lk(*mtx_);
+        header* h = head();
+        uint32_t i = h->count.load(std::memory_order_relaxed);
+        if (i == h->capacity) {
+            throw std::length_error("shm_stats_writer: segment is full");
+        }
+        entry& e = entries()[i];
+        std::strncpy(e.name, name.c_str(), name_size - 1);
+        e.type = type_tag<T>::value;
+        e.offset = h->size - (h->capacity - i) * Align;
+        void* p = base() + e.offset;
+        auto value = ::new (p) aligned_atomic<T, Align>(T(0));
+        h->count.store(i + 1, std::memory_order_release);
+        return *value;
+    }
+
+    // File descriptor of the segment, e.g., to pass it to a reader.
+    int fd() const noexcept { return region_.fd(); }
+
+  private:
+    shm_stats_writer(mapped_region region,
+                     size_t capacity,
+                     const std::string& name)
+      : region_(std::move(region))
+      , name_(name)
+    {
+        using namespace shm_stats_impl;
+        header* h = head();
+        h->version = version;
+        h->align = Align;
+        h->capacity = static_cast<uint32_t>(capacity);
+        h->name_size = name_size;
+        h->size = segment_size(capacity, Align);
+        h->count.store(0, std::memory_order_relaxed);
+        h->magic.store(magic, std::memory_order_release);
+    }
+
+    char* base() const noexcept { return static_cast<char*>(region_.data()); }
+
+    shm_stats_impl::header* head() const noexcept
+    {
+        return reinterpret_cast<shm_stats_impl::header*>(base());
+    }
+
+    shm_stats_impl::entry* entries() const noexcept
+    {
+        return reinterpret_cast<shm_stats_impl::entry*>(head() + 1);
+    }
+
+    mapped_region region_;
+    std::string name_;
+    std::unique_ptr<std::mutex> mtx_{ new std::mutex };
+};
+
+// Reader side of a statistics segment. Maps the segment read-only and loads
+// values without any cooperation from the writer.
+class shm_stats_reader
+{
+  public:
+    static shm_stats_reader open(const std::string& name)
+    {
+        return shm_stats_reader(
+          mapped_region::open_shm(name, mapped_region::access::read_only));
+    }
+
+    // Takes ownership of `fd`.
+    static shm_stats_reader open_fd(int fd)
+    {
+        return shm_stats_reader(
+          mapped_region(fd, mapped_region::access::read_only));
+    }
+
+    // Number of counters published so far.
+    size_t size() const noexcept
+    {
+        size_t n = head()->count.load(std::memory_order_acquire);
+        return n < capacity_ ? n : capacity_;
+    }
+
+    std::string name(size_t i) const
+    {
+        const char* name = entries()[i].name;
+        return std::string(name, strnlen(name, shm_stats_impl::name_size));
+    }
+
+    stat_type type(size_t i) const noexcept { return entries()[i].type; }
+
+    // Index of the counter called `name`, or `size()` if there is none.
+    size_t find(const std::string& name) const
+    {
+        size_t n = size();
+        for (size_t i = 0; i < n; ++i) {
+            if (this->name(i) == name) {
+                return i;
+            }
+        }
+        return n;
+    }
+
+    // Current value of counter `i`, converted to `T`. Throws
+    // `std::runtime_error` if the entry is corrupt.
+    template<class T>
+    T load(size_t i, std::memory_order order = std::memory_order_relaxed) const
+    {
+        const char* p = value(i);
+        switch (type(i)) {
+            case stat_type::u64:
+                return static_cast<T>(
+                  reinterpret_cast<const std::atomic<uint64_t>*>(p)->load(
+                    order));
+            case stat_type::i64:
+                return static_cast<T>(
+                  reinterpret_cast<const std::atomic<int64_t>*>(p)->load(
+                    order));
+            default:
+                return static_cast<T>(
+                  reinterpret_cast<const std::atomic<double>*>(p)->load(
+                    order));
+        }
+    }
+
+  private:
+    explicit shm_stats_reader(mapped_region region)
+      : region_(std::move(region))
+    {
+        using namespace shm_stats_impl;
+        if (region_.size() < sizeof(header) ||
+            head()->magic.load(std::memory_order_acquire) != magic) {
+            throw std::runtime_error("shm_stats_reader: not a stats segment");
+        }
+        if (head()->version != version || head()->name_size != name_size) {
+            throw std::runtime_error("shm_stats_reader: incompatible layout");
+        }
+        // The layout is copied, so that later changes to the (shared)
+        // header can't move reads out of the mapping.
+        capacity_ = head()->capacity;
+        align_ = head()->align;
+        size_ = head()->size;
+        if (align_ < 8 || (align_ & (align_ - 1)) != 0 ||
+            size_ != segment_size(capacity_, align_) ||
+            size_ > region_.size()) {
+            throw std::runtime_error("shm_stats_reader: corrupt header");
+        }
+        for (size_t i = 0; i < size(); ++i) {
+            value(i);
+        }
+    }
+
+    // Address of value `i`; it must be where the writer places it.
+    const char* value(size_t i) const
+    {
+        const shm_stats_impl::entry& e = entries()[i];
+        if (e.offset != size_ - (capacity_ - i) * align_ ||
+            e.type < stat_type::u64 || e.type > stat_type::f64) {
+            throw std::runtime_error("shm_stats_reader: corrupt entry");
+        }
+        return base() + e.offset;
+    }
+
+    const char* base() const noexcept
+    {
+        return static_cast<const char*>(region_.data());
+    }
+
+    const shm_stats_impl::header* head() const noexcept
+    {
+        return reinterpret_cast<const shm_stats_impl::header*>(base());
+    }
+
+    const shm_stats_impl::entry* entries() const noexcept
+    {
+        return reinterpret_cast<const shm_stats_impl::entry*>(head() + 1);
+    }
+
+    mapped_region region_;
+    size_t capacity_{ 0 };
+    size_t align_{ 0 };
+    size_t size_{ 0 };
+};
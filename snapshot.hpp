@@ -0,0 +1,251 @@
+// Copyright (c) 2021 Thomas Nagler
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "aligned_atomic.hpp"
+
+#include <algorithm> // std::copy
+#include <memory>    // std::unique_ptr
+#include <mutex>     // std::mutex, std::lock_guard
+#include <utility>   // std::pair, std::make_pair
+#include <vector>    // std::vector
+
+// How `snapshot_set::collect()` reads the registered atomics.
+enum class snapshot_mode
+{
+    // One relaxed load per atomic. Cheapest; values may come from different
+    // points in time.
+    relaxed,
+    // Every group is read under its sequence lock, so values within a group
+    // are consistent with each other (provided writers use `write_guard`).
+    seqlock,
+    // All atomics are read twice until both passes agree. Consistent across
+    // all groups if no value changes and changes back between two passes
+    // (e.g., for monotonic counters).
+    double_collect
+};
+
+// A registered set of atomics that can be copied into a packed (non-padded)
+// buffer in one call. Atomics are organized in groups; every group has a
+// sequence lock on its own cache line that writers can use to make related
+// updates appear atomic to `snapshot_mode::seqlock` readers.
+template<class T>
+class snapshot_set
+{
+    struct group;
+
+  public:
+    // Refers to a group of the set; valid as long as the set.
+    class group_handle
+    {
+      public:
+        group_handle() noexcept = default;
+
+      private:
+        friend class snapshot_set;
+
+        explicit group_handle(group* g) noexcept
+          : group_(g)
+        {}
+
+        group* group_{ nullptr };
+    };
+
+    // Brackets updates to a group. Concurrent writers of the same group are
+    // serialized; writers of different groups don't interact.
+    class write_guard
+    {
+      public:
+        explicit write_guard(group_handle g) noexcept
+          : seq_(g.group_->seq)
+        {
+            start_ = lock(seq_);
+        }
+
+        ~write_guard() { seq_.store(start_ + 2, std::memory_order_release); }
+
+        write_guard(const write_guard&) = delete;
+        write_guard& operator=(const write_guard&) = delete;
+
+      private:
+        aligned_atomic<uint64_t>& seq_;
+        uint64_t start_;
+    };
+
+    // Adds an empty group.
+    group_handle add_group()
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        groups_.push_back(std::unique_ptr<group>(new group));
+        return group_handle(groups_.back().get());
+    }
+
+    // Registers `source` in a group and returns its position in snapshots.
+    // `source` must outlive the set.
+    size_t add(group_handle g, const std::atomic<T>& source)
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        g.group_->sources.push_back(std::make_pair(&source, size_));
+        return size_++;
+    }
+
+    // Number of registered atomics (= length of a snapshot).
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        return size_;
+    }
+
+    // Writes the values of all registered atomics to `out[0, size())`.
+    // Returns false if `snapshot_mode::double_collect` didn't see two
+    // matching passes within `max_passes`; `out` then holds the last pass.
+    // `snapshot_mode::seqlock` always succeeds: after `max_passes` failed
+    // attempts on a group, the reader locks out its writers. If atomics may
+    // be added concurrently, use the `std::vector` overload, which sizes
+    // `out` under the same lock.
+    bool collect(T* out,
+                 snapshot_mode mode = snapshot_mode::relaxed,
+                 size_t max_passes = 8) const
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        return collect_locked(out, mode, max_passes);
+    }
+
+    bool collect(std::vector<T>& out,
+                 snapshot_mode mode = snapshot_mode::relaxed,
+                 size_t max_passes = 8) const
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        out.resize(size_);
+        return collect_locked(out.data(), mode, max_passes);
+    }
+
+  private:
+    bool collect_locked(T* out, snapshot_mode mode, size_t max_passes) const
+    {
+        switch (mode) {
+            case snapshot_mode::relaxed:
+                for (const auto& g : groups_) {
+                    read(*g, out, std::memory_order_relaxed);
+                }
+                return true;
+            case snapshot_mode::seqlock:
+                for (const auto& g : groups_) {
+                    read_consistent(*g, out, max_passes);
+                }
+                return true;
+            default:
+                return double_collect(out, max_passes);
+        }
+    }
+
+    // Groups are allocated individually, so that the sequence lock has a
+    // cache line of its own and handles stay valid when groups are added.
+    struct group
+    {
+        aligned_atomic<uint64_t> seq{ 0 };
+        std::vector<std::pair<const std::atomic<T>*, size_t>> sources;
+
+        static void* operator new(size_t count)
+        {
+            void* p = alloc_impl::aligned_malloc(count, alignof(group));
+            if (p == nullptr) {
+                throw std::bad_alloc();
+            }
+            return p;
+        }
+
+        static void operator delete(void* ptr)
+        {
+            alloc_impl::aligned_free(ptr);
+        }
+    };
+
+    // Acquires the sequence lock (odd = locked); returns the even value it
+    // had before. The fence keeps the writer's stores from becoming visible
+    // before the odd sequence number.
+    static uint64_t lock(aligned_atomic<uint64_t>& seq) noexcept
+    {
+        uint64_t s = seq.load(std::memory_order_relaxed);
+        while (true) {
+            if (s & 1) {
+                s = seq.load(std::memory_order_relaxed);
+            } else if (seq.compare_exchange_weak(
+                         s, s + 1, std::memory_order_acquire)) {
+                std::atomic_thread_fence(std::memory_order_release);
+                return s;
+            }
+        }
+    }
+
+    static void read(const group& g, T* out, std::memory_order order) noexcept
+    {
+        for (const auto& src : g.sources) {
+            out[src.second] = src.first->load(order);
+        }
+    }
+
+    static void read_consistent(const group& g,
+                                T* out,
+                                size_t max_passes) noexcept
+    {
+        auto& seq = const_cast<aligned_atomic<uint64_t>&>(g.seq);
+        for (size_t pass = 0; pass < max_passes; ++pass) {
+            uint64_t before = seq.load(std::memory_order_acquire);
+            if (before & 1) {
+                continue;
+            }
+            read(g, out, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seq.load(std::memory_order_relaxed) == before) {
+                return;
+            }
+        }
+        uint64_t start = lock(seq);
+        read(g, out, std::memory_order_relaxed);
+        seq.store(start, std::memory_order_release);
+    }
+
+    bool double_collect(T* out, size_t max_passes) const
+    {
+        std::vector<T> previous(size_);
+        for (const auto& g : groups_) {
+            read(*g, previous.data(), std::memory_order_acquire);
+        }
+        for (size_t pass = 1; pass < max_passes; ++pass) {
+            bool same = true;
+            for (const auto& g : groups_) {
+                for (const auto& src : g->sources) {
+                    T value = src.first->load(std::memory_order_acquire);
+                    same = same && value == previous[src.second];
+                    out[src.second] = value;
+                }
+            }
+            if (same) {
+                return true;
+            }
+            previous.assign(out, out + size_);
+        }
+        std::copy(previous.begin(), previous.end(), out);
+        return false;
+    }
+
+    mutable std::mutex mtx_;
+    std::vector<std::unique_ptr<group>> groups_;
+    size_t size_{ 0 };
+};
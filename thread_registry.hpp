@@ -0,0 +1,265 @@
+// Copyright (c) 2021 Thomas Nagler
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "aligned_atomic.hpp"
+
+#include <algorithm>  // std::push_heap, std::pop_heap
+#include <functional> // std::greater
+#include <mutex>      // std::mutex, std::lock_guard
+#include <vector>     // std::vector
+
+namespace thread_registry_impl {
+
+constexpr size_t npos = static_cast<size_t>(-1);
+
+// Hands out dense thread indices. Released indices go to a min-heap, so that
+// the smallest free index is reused first and the range of indices in use
+// stays as compact as possible.
+class registry
+{
+  public:
+    static registry& instance()
+    {
+        static registry r;
+        return r;
+    }
+
+    size_t acquire()
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        if (!free_.empty()) {
+            std::pop_heap(free_.begin(), free_.end(), std::greater<size_t>());
+            size_t index = free_.back();
+            free_.pop_back();
+            return index;
+        }
+        size_t index = size_.load(std::memory_order_relaxed);
+        size_.store(index + 1, std::memory_order_release);
+        return index;
+    }
+
+    void release(size_t index)
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        free_.push_back(index);
+        std::push_heap(free_.begin(), free_.end(), std::greater<size_t>());
+    }
+
+    size_t size() const noexcept
+    {
+        return size_.load(std::memory_order_acquire);
+    }
+
+  private:
+    registry() = default;
+
+    std::mutex mtx_;
+    std::vector<size_t> free_;
+    aligned_atomic<size_t> size_{ 0 };
+};
+
+// Index of the calling thread. Trivially initialized, so access is a plain
+// TLS read without guard variable.
+inline size_t&
+cached_index() noexcept
+{
+    static thread_local size_t index = npos;
+    return index;
+}
+
+// Whether the calling thread's `exit_guard` has been destroyed. Trivially
+// destructible, so it stays readable during the rest of thread exit.
+inline bool&
+guard_destroyed() noexcept
+{
+    static thread_local bool destroyed = false;
+    return destroyed;
+}
+
+// Gives the index back to the registry when the owning thread exits.
+struct exit_guard
+{
+    size_t index{ npos };
+
+    ~exit_guard()
+    {
+        if (index != npos) {
+            registry::instance().release(index);
+            cached_index() = npos;
+        }
+        guard_destroyed() = true;
+    }
+};
+
+inline size_t
+register_thread()
+{
+    // Called from a thread_local destructor that runs after the guard's:
+    // take an index that is never released rather than registering with a
+    // dead guard (and possibly sharing the index with a new thread).
+    if (guard_destroyed()) {
+        cached_index() = registry::instance().acquire();
+        return cached_index();
+    }
+    static thread_local exit_guard guard;
+    guard.index = registry::instance().acquire();
+    cached_index() = guard.index;
+    return guard.index;
+}
+
+// Integer log2 for positive numbers.
+constexpr size_t
+static_log2(size_t x)
+{
+    return x < 2 ? 0 : 1 + static_log2(x / 2);
+}
+
+inline size_t
+log2(size_t x) noexcept
+{
+#if defined(__GNUC__)
+    return sizeof(unsigned long long) * 8 - 1 - __builtin_clzll(x);
+#else
+    size_t r = 0;
+    while (x >>= 1) {
+        ++r;
+    }
+    return r;
+#endif
+}
+
+} // end namespace thread_registry_impl
+
+// Dense, recyclable thread indices. A thread is assigned the smallest free
+// index on its first call to `index()`; the index is released when the thread
+// exits and will be handed out to the next new thread.
+struct thread_registry
+{
+    static constexpr size_t npos = thread_registry_impl::npos;
+
+    // Index of the calling thread. After the first call, this is a single
+    // thread-local read.
+    static size_t index()
+    {
+        size_t index = thread_registry_impl::cached_index();
+        if (index != npos) {
+            return index;
+        }
+        return thread_registry_impl::register_thread();
+    }
+
+    // Upper bound on all indices handed out so far. Indices of live threads
+    // are in `[0, size())`.
+    static size_t size() noexcept
+    {
+        return thread_registry_impl::registry::instance().size();
+    }
+};
+
+// Array of `T`s indexed by thread index. Storage is split into segments of
+// geometrically increasing size that are allocated on first use and never
+// moved, so references to slots stay valid while the array grows.
+//
+// Slots are not reset when an index is recycled; a new thread inherits the
+// state left behind by the previous owner of its index.
+template<class T, size_t FirstSegment = 64>
+class thread_slots
+{
+    static_assert((FirstSegment & (FirstSegment - 1)) == 0,
+                  "FirstSegment must be a power of two.");
+
+  public:
+    thread_slots() noexcept
+    {
+        for (auto& segment : segments_) {
+            segment.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    thread_slots(const thread_slots&) = delete;
+    thread_slots& operator=(const thread_slots&) = delete;
+
+    ~thread_slots()
+    {
+        for (size_t k = 0; k < max_segments; ++k) {
+            delete segments_[k].load(std::memory_order_relaxed);
+        }
+    }
+
+    // Slot for thread index `i`; allocates the segment holding it if
+    // necessary.
+    T& operator[](size_t i)
+    {
+        size_t j = i + FirstSegment;
+        size_t k = thread_registry_impl::log2(j) - first_bits;
+        segment* s = segments_[k].load(std::memory_order_acquire);
+        if (s == nullptr) {
+            s = allocate(k);
+        }
+        return (*s)[j - (FirstSegment << k)];
+    }
+
+    // Slot of the calling thread.
+    T& local() { return (*this)[thread_registry::index()]; }
+
+    // Calls `f(T&)` for all slots that have been allocated and belong to an
+    // index that has been handed out.
+    template<class F>
+    void for_each(F f)
+    {
+        size_t n = thread_registry::size();
+        for (size_t k = 0; k < max_segments; ++k) {
+            size_t first = (FirstSegment << k) - FirstSegment;
+            if (first >= n) {
+                break;
+            }
+            segment* s = segments_[k].load(std::memory_order_acquire);
+            if (s == nullptr) {
+                continue;
+            }
+            size_t last = first + s->size() < n ? first + s->size() : n;
+            for (size_t i = 0; i < last - first; ++i) {
+                f((*s)[i]);
+            }
+        }
+    }
+
+  private:
+    using segment = alloc_impl::aligned_array<T>;
+    static constexpr size_t first_bits =
+      thread_registry_impl::static_log2(FirstSegment);
+    static constexpr size_t max_segments = sizeof(size_t) * 8 - first_bits;
+
+    segment* allocate(size_t k)
+    {
+        segment* fresh = new segment(FirstSegment << k);
+        segment* expected = nullptr;
+        if (!segments_[k].compare_exchange_strong(expected,
+                                                  fresh,
+                                                  std::memory_order_acq_rel,
+                                                  std::memory_order_acquire)) {
+            // Another thread was faster.
+            delete fresh;
+            return expected;
+        }
+        return fresh;
+    }
+
+    std::atomic<segment*> segments_[max_segments];
+};
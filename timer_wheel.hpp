@@ -0,0 +1,271 @@
+// Copyright (c) 2021 Thomas Nagler
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "aligned_atomic.hpp"
+
+#include <chrono>      // std::chrono::steady_clock
+#include <cstdint>     // uint32_t, uint64_t
+#include <stdexcept>   // std::invalid_argument
+#include <type_traits> // std::is_base_of
+
+namespace timer_wheel_impl {
+
+// Timer states.
+constexpr uint32_t idle = 0;      // not scheduled
+constexpr uint32_t pending = 1;   // scheduled, will fire
+constexpr uint32_t cancelled = 2; // scheduled, will be dropped
+
+constexpr size_t level_bits = 6;
+constexpr size_t slots_per_level = size_t(1) << level_bits;
+constexpr size_t num_levels = 4;
+
+} // end namespace timer_wheel_impl
+
+// Base class of timers managed by a `timer_wheel`.
+struct timer_node
+{
+    std::atomic<uint32_t> state{ timer_wheel_impl::idle };
+    uint64_t deadline{ 0 }; // in ticks
+    timer_node* next{ nullptr };
+};
+
+// Hierarchical timer wheel (Varghese and Lauck, 1987) with four levels of 64
+// slots, covering 2^24 ticks; later timers are parked in the top level and
+// re-cascaded. Timers are intrusive (they derive from `timer_node`), so the
+// wheel never allocates.
+//
+// Any thread can schedule and cancel timers; a single thread advances the
+// wheel and runs the expiry callbacks. Scheduling pushes the timer onto an
+// MPSC inbox (an `aligned_atomic` list head) with one CAS; the ticking
+// thread moves the inbox into the wheel. Cancelling is a CAS on the timer's
+// state word; the ticking thread unlinks the timer when it reaches it.
+template<class Node = timer_node, size_t Align = 64>
+class timer_wheel
+{
+    static_assert(std::is_base_of<timer_node, Node>::value,
+                  "Node must derive from timer_node.");
+
+  public:
+    using clock = std::chrono::steady_clock;
+
+    // Timers fire with a granularity of `resolution`.
+    explicit timer_wheel(
+      clock::duration resolution = std::chrono::milliseconds(1),
+      clock::time_point start = clock::now())
+      : resolution_(check(resolution))
+      , start_(start)
+    {
+        for (auto& level : slots_) {
+            for (auto& head : level) {
+                head = nullptr;
+            }
+        }
+    }
+
+    timer_wheel(const timer_wheel&) = delete;
+    timer_wheel& operator=(const timer_wheel&) = delete;
+
+    // Any thread. Schedules `timer` to fire at the first tick not before
+    // `when`. Returns false if it is still scheduled, or cancelled but not
+    // yet released by the ticking thread.
+    bool schedule(Node* timer, clock::time_point when) noexcept
+    {
+        using namespace timer_wheel_impl;
+        uint32_t expected = idle;
+        if (!timer->state.compare_exchange_strong(
+              expected, pending, std::memory_order_acquire)) {
+            return false;
+        }
+        timer->deadline = ticks_ceil(when);
+        timer_node* head = inbox_.load(std::memory_order_relaxed);
+        do {
+            timer->next = head;
+        } while (!inbox_.compare_exchange_weak(
+          head, timer, std::memory_order_release, std::memory_order_relaxed));
+        return true;
+    }
+
+    bool schedule(Node* timer, clock::duration delay) noexcept
+    {
+        return schedule(timer, clock::now() + delay);
+    }
+
+    // Any thread. Prevents `timer` from firing; returns false if it wasn't
+    // scheduled or has fired already. The timer stays linked until the
+    // ticking thread reaches it: its memory must remain valid until
+    // `released()` returns true.
+    static bool cancel(Node* timer) noexcept
+    {
+        uint32_t expected = timer_wheel_impl::pending;
+        return timer->state.compare_exchange_strong(
+          expected, timer_wheel_impl::cancelled, std::memory_order_relaxed);
+    }
+
+    // Whether the wheel holds no reference to `timer`.
+    static bool released(const Node* timer) noexcept
+    {
+        return timer->state.load(std::memory_order_acquire) ==
+               timer_wheel_impl::idle;
+    }
+
+    // Ticking thread. Advances the wheel to `now` and calls `on_expire(Node*)`
+    // for every timer that is due. The timer is released before the call, so
+    // the callback may reschedule or free it. Returns the number of expired
+    // timers.
+    template<class F>
+    size_t advance(F on_expire, clock::time_point now = clock::now())
+    {
+        using namespace timer_wheel_impl;
+        timer_node* t = inbox_.exchange(nullptr, std::memory_order_acquire);
+        while (t != nullptr) {
+            timer_node* next = t->next;
+            place(t);
+            t = next;
+        }
+
+        size_t fired = expire(take(due_), on_expire);
+        uint64_t target = ticks_floor(now);
+        while (now_ < target) {
+            ++now_;
+            // Cascade higher levels whose slot boundary we just crossed.
+            for (size_t level = 1; level < num_levels; ++level) {
+                if ((now_ & mask(level - 1)) != 0) {
+                    break;
+                }
+                size_t slot = (now_ >> (level_bits * level)) & mask(0);
+                timer_node* list = take(slots_[level][slot]);
+                while (list != nullptr) {
+                    timer_node* next = list->next;
+                    place(list);
+                    list = next;
+                }
+            }
+            fired += expire(take(slots_[0][now_ & mask(0)]), on_expire);
+            fired += expire(take(due_), on_expire);
+        }
+        return fired;
+    }
+
+    // Current time of the wheel in ticks since `start`.
+    uint64_t now_ticks() const noexcept { return now_; }
+
+  private:
+    static clock::duration check(clock::duration resolution)
+    {
+        if (resolution.count() <= 0) {
+            throw std::invalid_argument(
+              "timer_wheel: resolution must be positive");
+        }
+        return resolution;
+    }
+
+    static timer_node* take(timer_node*& head) noexcept
+    {
+        timer_node* list = head;
+        head = nullptr;
+        return list;
+    }
+
+    static uint64_t mask(size_t level) noexcept
+    {
+        return (uint64_t(1) << (timer_wheel_impl::level_bits * (level + 1))) -
+               1;
+    }
+
+    uint64_t ticks_floor(clock::time_point t) const noexcept
+    {
+        return t <= start_
+                 ? 0
+                 : static_cast<uint64_t>((t - start_) / resolution_);
+    }
+
+    uint64_t ticks_ceil(clock::time_point t) const noexcept
+    {
+        return t <= start_ ? 0
+                           : static_cast<uint64_t>(
+                               (t - start_ + resolution_ - clock::duration(1)) /
+                               resolution_);
+    }
+
+    // Links `t` into the slot for its deadline, relative to `now_`; drops it
+    // if it was cancelled.
+    void place(timer_node* t) noexcept
+    {
+        using namespace timer_wheel_impl;
+        if (t->state.load(std::memory_order_relaxed) == cancelled) {
+            t->state.store(idle, std::memory_order_release);
+            return;
+        }
+        if (t->deadline <= now_) {
+            t->next = due_;
+            due_ = t;
+            return;
+        }
+        uint64_t delta = t->deadline - now_;
+        uint64_t deadline = t->deadline;
+        size_t level = 0;
+        while (level + 1 < num_levels && delta > mask(level)) {
+            ++level;
+        }
+        if (delta > mask(level)) {
+            deadline = now_ + mask(level); // parked, re-cascaded later
+        }
+        timer_node*& head =
+          slots_[level][(deadline >> (level_bits * level)) & mask(0)];
+        t->next = head;
+        head = t;
+    }
+
+    // Releases and reports the timers in `list` that are due; places the
+    // others (which were parked) anew.
+    template<class F>
+    size_t expire(timer_node* list, F& on_expire)
+    {
+        using namespace timer_wheel_impl;
+        size_t fired = 0;
+        while (list != nullptr) {
+            timer_node* t = list;
+            list = t->next;
+            if (t->deadline > now_) {
+                place(t);
+                continue;
+            }
+            uint32_t expected = pending;
+            if (t->state.compare_exchange_strong(
+                  expected, idle, std::memory_order_acq_rel)) {
+                ++fired;
+                on_expire(static_cast<Node*>(t));
+            } else {
+                t->state.store(idle, std::memory_order_release);
+            }
+        }
+        return fired;
+    }
+
+    clock::duration resolution_;
+    clock::time_point start_;
+
+    aligned_atomic<timer_node*, Align> inbox_{ nullptr };
+
+    // Ticking thread only.
+    uint64_t now_{ 0 };
+    timer_node* due_{ nullptr };
+    timer_node* slots_[timer_wheel_impl::num_levels]
+                      [timer_wheel_impl::slots_per_level];
+};
@@ -0,0 +1,236 @@
+// Copyright (c) 2021 Thomas Nagler
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "aligned_atomic.hpp"
+#include "thread_registry.hpp"
+
+#include <algorithm>     // std::sort
+#include <cstdint>       // uint64_t
+#include <cstring>       // std::memcpy
+#include <functional>    // std::hash
+#include <stdexcept>     // std::invalid_argument
+#include <type_traits>   // std::is_trivially_copyable
+#include <unordered_map> // std::unordered_map
+#include <vector>        // std::vector
+
+// Approximate top-k (heavy hitters) tracker after Space-Saving (Metwally,
+// Agrawal, and El Abbadi, 2005). Threads count keys in small local maps and
+// merge them into a shared summary of `capacity` counters when a map is
+// full or on `flush()`, so the shared state is touched once per batch. A
+// single spinlock on its own line serializes merges.
+//
+// After each merge, the summary is published to a seqlocked buffer of
+// atomic words, from which `top()` copies consistent snapshots without
+// taking the lock. Every key with a true count above `N / capacity` (N =
+// total merged count) is in the summary, and its count is overestimated by
+// at most its `error`.
+template<class Key, class Hash = std::hash<Key>, size_t Align = 64>
+class top_k
+{
+  public:
+    struct entry
+    {
+        Key key;
+        uint64_t count;
+        uint64_t error;
+    };
+
+    static_assert(std::is_trivially_copyable<entry>::value,
+                  "Key must be trivially copyable.");
+
+    explicit top_k(size_t capacity, size_t local_capacity = 256)
+      : capacity_(check_capacity(capacity))
+      , local_capacity_(local_capacity > 0 ? local_capacity : 1)
+      , published_(1 + capacity * words_per_entry)
+    {
+        summary_.reserve(capacity);
+        index_.reserve(capacity);
+    }
+
+    top_k(const top_k&) = delete;
+    top_k& operator=(const top_k&) = delete;
+
+    ~top_k()
+    {
+        locals_.for_each([](std::atomic<local_map*>& m) { delete m.load(); });
+    }
+
+    // Counts `key` in the calling thread's map.
+    void add(const Key& key, uint64_t n = 1)
+    {
+        local_map& m = local();
+        m[key] += n;
+        if (m.size() >= local_capacity_) {
+            merge(m);
+        }
+    }
+
+    // Merges the calling thread's map into the shared summary. Threads
+    // should call this before they stop adding.
+    void flush() { merge(local()); }
+
+    // The (up to) `k` entries with the largest counts, largest first, as of
+    // the last merge.
+    std::vector<entry> top(size_t k) const
+    {
+        std::vector<entry> result;
+        std::vector<uint64_t> words(published_.size());
+        while (true) {
+            uint64_t before = seq_.load(std::memory_order_acquire);
+            if (before & 1) {
+                continue;
+            }
+            for (size_t i = 0; i < words.size(); ++i) {
+                words[i] = published_[i].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seq_.load(std::memory_order_relaxed) == before) {
+                break;
+            }
+        }
+        result.resize(static_cast<size_t>(words[0]));
+        for (size_t i = 0; i < result.size(); ++i) {
+            std::memcpy(&result[i],
+                        &words[1 + i * words_per_entry],
+                        sizeof(entry));
+        }
+        std::sort(result.begin(),
+                  result.end(),
+                  [](const entry& a, const entry& b) {
+                      return a.count > b.count;
+                  });
+        if (result.size() > k) {
+            result.resize(k);
+        }
+        return result;
+    }
+
+  private:
+    using local_map = std::unordered_map<Key, uint64_t, Hash>;
+
+    static constexpr size_t words_per_entry =
+      (sizeof(entry) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    static size_t check_capacity(size_t capacity)
+    {
+        if (capacity == 0) {
+            throw std::invalid_argument("top_k: capacity must be positive");
+        }
+        return capacity;
+    }
+
+    local_map& local()
+    {
+        std::atomic<local_map*>& slot = locals_.local();
+        local_map* m = slot.load(std::memory_order_relaxed);
+        if (m == nullptr) {
+            m = new local_map;
+            slot.store(m, std::memory_order_relaxed);
+        }
+        return *m;
+    }
+
+    void merge(local_map& m)
+    {
+        lock();
+        try {
+            for (const auto& kv : m) {
+                insert(kv.first, kv.second);
+            }
+        } catch (...) {
+            unlock();
+            throw;
+        }
+        publish();
+        unlock();
+        m.clear();
+    }
+
+    // Space-Saving update; called under the lock.
+    void insert(const Key& key, uint64_t n)
+    {
+        auto it = index_.find(key);
+        if (it != index_.end()) {
+            summary_[it->second].count += n;
+            return;
+        }
+        if (summary_.size() < capacity_) {
+            index_.emplace(key, summary_.size());
+            summary_.push_back(entry{ key, n, 0 });
+            return;
+        }
+        // Replace the entry with the smallest count; the newcomer inherits
+        // that count as its error.
+        size_t min = 0;
+        for (size_t i = 1; i < summary_.size(); ++i) {
+            if (summary_[i].count < summary_[min].count) {
+                min = i;
+            }
+        }
+        entry& e = summary_[min];
+        index_.emplace(key, min);
+        index_.erase(e.key);
+        e.error = e.count;
+        e.count += n;
+        e.key = key;
+    }
+
+    // Copies the summary to the seqlocked buffer; called under the lock.
+    void publish() noexcept
+    {
+        uint64_t s = seq_.load(std::memory_order_relaxed);
+        seq_.store(s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        published_[0].store(summary_.size(), std::memory_order_relaxed);
+        for (size_t i = 0; i < summary_.size(); ++i) {
+            uint64_t words[words_per_entry] = {};
+            std::memcpy(words, &summary_[i], sizeof(entry));
+            for (size_t j = 0; j < words_per_entry; ++j) {
+                published_[1 + i * words_per_entry + j].store(
+                  words[j], std::memory_order_relaxed);
+            }
+        }
+        seq_.store(s + 2, std::memory_order_release);
+    }
+
+    void lock() noexcept
+    {
+        while (lock_.exchange(true, std::memory_order_acquire)) {
+            while (lock_.load(std::memory_order_relaxed)) {
+            }
+        }
+    }
+
+    void unlock() noexcept { lock_.store(false, std::memory_order_release); }
+
+    const size_t capacity_;
+    const size_t local_capacity_;
+
+    aligned_atomic<bool, Align> lock_{ false };
+    std::vector<entry> summary_;
+    std::unordered_map<Key, size_t, Hash> index_;
+
+    aligned_atomic<uint64_t, Align> seq_{ 0 };
+    alloc_impl::aligned_array<std::atomic<uint64_t>> published_;
+
+    thread_slots<std::atomic<local_map*>> locals_;
+};
+
+template<class Key, class Hash, size_t Align>
+constexpr size_t top_k<Key, Hash, Align>::words_per_entry;
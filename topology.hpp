@@ -0,0 +1,306 @@
+// Copyright (c) 2021 Thomas Nagler
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "aligned_atomic.hpp"
+
+#include <fstream> // std::ifstream
+#include <map>     // std::map
+#include <string>  // std::string, std::to_string
+#include <thread>  // std::thread::hardware_concurrency
+#include <utility> // std::make_pair, std::move
+#include <vector>  // std::vector
+
+#if defined(__linux__)
+#include <sched.h> // sched_getcpu
+#endif
+
+// Levels of the CPU hierarchy, from finest to coarsest. Each level groups
+// the CPUs that share a resource: `core` groups SMT siblings (which share L1),
+// `l2` and `llc` group CPUs sharing the respective cache, and `node` groups
+// CPUs attached to the same NUMA node.
+enum class topology_level
+{
+    cpu = 0,
+    core = 1,
+    l2 = 2,
+    llc = 3,
+    node = 4
+};
+
+namespace topology_impl {
+
+constexpr size_t num_levels = 5;
+constexpr size_t npos = static_cast<size_t>(-1);
+
+// Parses a sysfs CPU list like "0-3,8,10-11". Returns an empty vector if the
+// file can't be read.
+inline std::vector<size_t>
+read_cpu_list(const std::string& path)
+{
+    std::vector<size_t> cpus;
+    std::ifstream file(path);
+    std::string list;
+    if (!(file >> list)) {
+        return cpus;
+    }
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        std::string range = list.substr(pos, end - pos);
+        size_t dash = range.find('-');
+        try {
+            size_t first = std::stoul(range.substr(0, dash));
+            size_t last = (dash == std::string::npos)
+                            ? first
+                            : std::stoul(range.substr(dash + 1));
+            for (size_t cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        } catch (...) {
+            return std::vector<size_t>();
+        }
+        pos = end + 1;
+    }
+    return cpus;
+}
+
+inline bool
+read_value(const std::string& path, std::string& value)
+{
+    std::ifstream file(path);
+    return static_cast<bool>(file >> value);
+}
+
+} // end namespace topology_impl
+
+// CPU topology of the machine, as described by `/sys/devices/system`. Every
+// CPU belongs to exactly one domain per level; domains are numbered densely
+// from zero in order of their smallest CPU.
+//
+// Information that is missing (e.g., inside containers or on other operating
+// systems) degrades gracefully: a CPU without known SMT siblings is its own
+// core, a CPU without a known L2 uses its core, and so on.
+class cpu_topology
+{
+  public:
+    // Topology of the running system, parsed once.
+    static const cpu_topology& system()
+    {
+        static const cpu_topology topo = parse();
+        return topo;
+    }
+
+    // Parses the topology below `root` (the default is the real sysfs,
+    // other roots are useful for testing).
+    static cpu_topology parse(const std::string& root = "/sys/devices/system")
+    {
+        using namespace topology_impl;
+        std::string cpu_dir = root + "/cpu";
+        std::vector<size_t> cpus = read_cpu_list(cpu_dir + "/possible");
+        if (cpus.empty()) {
+            return flat(std::thread::hardware_concurrency());
+        }
+
+        cpu_topology topo;
+        size_t n = cpus.back() + 1;
+        for (auto& domains : topo.domain_) {
+            domains.assign(n, npos);
+        }
+
+        // Each domain is identified by its smallest CPU first, then mapped to
+        // dense numbers below.
+        for (size_t cpu : cpus) {
+            std::string dir = cpu_dir + "/cpu" + std::to_string(cpu);
+            topo.domain_[0][cpu] = cpu;
+            topo.domain_[1][cpu] = first_of(
+              read_cpu_list(dir + "/topology/thread_siblings_list"), cpu);
+            topo.domain_[2][cpu] = topo.domain_[1][cpu];
+            topo.domain_[3][cpu] = npos;
+            size_t llc_level = 0;
+            for (size_t index = 0;; ++index) {
+                std::string cache =
+                  dir + "/cache/index" + std::to_string(index);
+                std::string level, type;
+                if (!read_value(cache + "/level", level)) {
+                    break;
+                }
+                read_value(cache + "/type", type);
+                if (type == "Instruction") {
+                    continue;
+                }
+                size_t lvl = level[0] - '0';
+                size_t first =
+                  first_of(read_cpu_list(cache + "/shared_cpu_list"), cpu);
+                if (lvl == 2) {
+                    topo.domain_[2][cpu] = first;
+                }
+                if (lvl >= 2 && lvl >= llc_level) {
+                    topo.domain_[3][cpu] = first;
+                    llc_level = lvl;
+                }
+            }
+            if (topo.domain_[3][cpu] == npos) {
+                topo.domain_[3][cpu] = topo.domain_[2][cpu];
+            }
+            topo.domain_[4][cpu] = 0;
+        }
+
+        // NUMA nodes list their CPUs.
+        std::vector<size_t> nodes = read_cpu_list(root + "/node/possible");
+        for (size_t node : nodes) {
+            std::string path =
+              root + "/node/node" + std::to_string(node) + "/cpulist";
+            for (size_t cpu : read_cpu_list(path)) {
+                if (cpu < n) {
+                    topo.domain_[4][cpu] = node;
+                }
+            }
+        }
+
+        topo.renumber();
+        return topo;
+    }
+
+    // Topology without any sharing: every CPU is its own core, cache domain
+    // and (all in one) node.
+    static cpu_topology flat(size_t num_cpus)
+    {
+        cpu_topology topo;
+        num_cpus = num_cpus > 0 ? num_cpus : 1;
+        for (size_t lvl = 0; lvl < topology_impl::num_levels; ++lvl) {
+            topo.domain_[lvl].resize(num_cpus);
+            for (size_t cpu = 0; cpu < num_cpus; ++cpu) {
+                topo.domain_[lvl][cpu] = (lvl == 4) ? 0 : cpu;
+            }
+        }
+        topo.renumber();
+        return topo;
+    }
+
+    // Number of CPU ids (largest id plus one; offline CPUs included).
+    size_t num_cpus() const noexcept { return domain_[0].size(); }
+
+    // Number of distinct domains at a level.
+    size_t num_domains(topology_level level) const noexcept
+    {
+        return num_domains_[static_cast<size_t>(level)];
+    }
+
+    // Domain of a CPU at a level. CPU ids beyond `num_cpus()` (hot-plugged
+    // after parsing) wrap around.
+    size_t domain_of(size_t cpu, topology_level level) const noexcept
+    {
+        return domain_[static_cast<size_t>(level)][cpu % num_cpus()];
+    }
+
+    // CPUs belonging to a domain.
+    std::vector<size_t> cpus_in(size_t domain, topology_level level) const
+    {
+        std::vector<size_t> cpus;
+        for (size_t cpu = 0; cpu < num_cpus(); ++cpu) {
+            if (domain_of(cpu, level) == domain) {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+
+    // CPU the calling thread is currently running on. The thread may migrate
+    // at any time, so this is a placement hint, not an ownership guarantee.
+    static size_t current_cpu() noexcept
+    {
+#if defined(__linux__)
+        int cpu = sched_getcpu();
+        return cpu >= 0 ? static_cast<size_t>(cpu) : 0;
+#else
+        return 0;
+#endif
+    }
+
+  private:
+    cpu_topology() = default;
+
+    static size_t first_of(const std::vector<size_t>& cpus, size_t fallback)
+    {
+        return cpus.empty() ? fallback : cpus.front();
+    }
+
+    // Maps domain identifiers to 0, 1, 2, ... in order of appearance. CPUs
+    // that are not possible (holes in the id range) get their own domain.
+    void renumber()
+    {
+        for (size_t lvl = 0; lvl < topology_impl::num_levels; ++lvl) {
+            std::map<size_t, size_t> ids;
+            for (size_t cpu = 0; cpu < num_cpus(); ++cpu) {
+                size_t& d = domain_[lvl][cpu];
+                size_t key = (d == topology_impl::npos) ? num_cpus() + cpu : d;
+                d = ids.insert(std::make_pair(key, ids.size())).first->second;
+            }
+            num_domains_[lvl] = ids.size();
+        }
+    }
+
+    std::vector<size_t> domain_[topology_impl::num_levels];
+    size_t num_domains_[topology_impl::num_levels]{};
+};
+
+// One `T` per topology domain. With `topology_level::core`, hyperthread
+// siblings share a slot (they share L1 anyway), while CPUs in different cache
+// domains never do. Use e.g. `cpu_slots<aligned_atomic<size_t>>` so that
+// slots don't share cache lines among themselves.
+template<class T>
+class cpu_slots
+{
+  public:
+    explicit cpu_slots(topology_level level,
+                       cpu_topology topo = cpu_topology::system())
+      : topo_(std::move(topo))
+      , level_(level)
+      , slots_(topo_.num_domains(level))
+    {}
+
+    // Slot of the CPU the calling thread is running on.
+    T& local() noexcept { return slot_of(cpu_topology::current_cpu()); }
+
+    T& slot_of(size_t cpu) noexcept
+    {
+        return slots_[topo_.domain_of(cpu, level_)];
+    }
+
+    T& operator[](size_t domain) noexcept { return slots_[domain]; }
+    const T& operator[](size_t domain) const noexcept { return slots_[domain]; }
+
+    size_t size() const noexcept { return slots_.size(); }
+
+    T* begin() noexcept { return slots_.begin(); }
+    T* end() noexcept { return slots_.end(); }
+    const T* begin() const noexcept { return slots_.begin(); }
+    const T* end() const noexcept { return slots_.end(); }
+
+    const cpu_topology& topology() const noexcept { return topo_; }
+    topology_level level() const noexcept { return level_; }
+
+  private:
+    cpu_topology topo_;
+    topology_level level_;
+    alloc_impl::aligned_array<T> slots_;
+};
@@ -0,0 +1,165 @@
+// Copyright (c) 2021 Thomas Nagler
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "topology.hpp"
+
+#include <chrono>      // std::chrono::steady_clock
+#include <mutex>       // std::mutex, std::lock_guard, std::unique_lock
+#include <type_traits> // std::is_integral
+#include <vector>      // std::vector
+
+// Counter organized as a combining tree that follows the machine topology:
+// per-CPU leaves, one node per last-level cache, one per NUMA node, and a
+// root. Updates go to the leaf of the current CPU. Values are periodically
+// moved up the tree, so that an approximate read touches a single line, the
+// root. Exact reads sum all nodes of the tree.
+template<class T = int64_t, size_t Align = 64>
+class tree_counter
+{
+    static_assert(std::is_integral<T>::value, "T must be an integral type.");
+
+  public:
+    using clock = std::chrono::steady_clock;
+
+    // `max_staleness` bounds the age of values returned by `read()`,
+    // provided that somebody reads the counter at least that often.
+    explicit tree_counter(
+      clock::duration max_staleness = std::chrono::milliseconds(10),
+      const cpu_topology& topo = cpu_topology::system())
+      : max_staleness_(max_staleness.count())
+      , leaves_(topology_level::cpu, topo)
+      , llcs_(topology_level::llc, topo)
+      , nodes_(topology_level::node, topo)
+      , leaf_parent_(leaves_.size())
+      , llc_parent_(llcs_.size())
+    {
+        for (size_t cpu = 0; cpu < topo.num_cpus(); ++cpu) {
+            size_t llc = topo.domain_of(cpu, topology_level::llc);
+            leaf_parent_[topo.domain_of(cpu, topology_level::cpu)] = llc;
+            llc_parent_[llc] = topo.domain_of(cpu, topology_level::node);
+        }
+        last_propagation_.store(clock::now().time_since_epoch().count());
+    }
+
+    tree_counter(const tree_counter&) = delete;
+    tree_counter& operator=(const tree_counter&) = delete;
+
+    // Adds `n` to the leaf of the current CPU.
+    void add(T n) noexcept
+    {
+        leaves_.local().fetch_add(n, std::memory_order_relaxed);
+    }
+
+    tree_counter& operator+=(T n) noexcept
+    {
+        add(n);
+        return *this;
+    }
+
+    tree_counter& operator++() noexcept
+    {
+        add(1);
+        return *this;
+    }
+
+    // Value at the time of the last propagation. If that is older than
+    // `max_staleness`, a propagation is triggered first (unless another
+    // thread is already propagating).
+    T read()
+    {
+        if (is_stale()) {
+            std::unique_lock<std::mutex> lk(mtx_, std::try_to_lock);
+            if (lk.owns_lock()) {
+                propagate_locked();
+            }
+        }
+        return root_.load(std::memory_order_relaxed);
+    }
+
+    // Exact value, summed over all nodes of the tree. Blocks propagation
+    // while reading, so that no value is in transit between two levels.
+    T read_exact()
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        T sum = root_.load(std::memory_order_relaxed);
+        for (const auto& node : nodes_) {
+            sum += node.load(std::memory_order_relaxed);
+        }
+        for (const auto& llc : llcs_) {
+            sum += llc.load(std::memory_order_relaxed);
+        }
+        for (const auto& leaf : leaves_) {
+            sum += leaf.load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+    // Moves all leaf values up to the root.
+    void propagate()
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        propagate_locked();
+    }
+
+  private:
+    using node_type = aligned_atomic<T, Align>;
+
+    bool is_stale() const noexcept
+    {
+        auto now = clock::now().time_since_epoch().count();
+        return now - last_propagation_.load(std::memory_order_relaxed) >
+               max_staleness_;
+    }
+
+    // Every level is emptied into the next one with `exchange()`, so
+    // concurrent updates to the leaves are never lost.
+    void propagate_locked() noexcept
+    {
+        for (size_t i = 0; i < leaves_.size(); ++i) {
+            move(leaves_[i], llcs_[leaf_parent_[i]]);
+        }
+        for (size_t i = 0; i < llcs_.size(); ++i) {
+            move(llcs_[i], nodes_[llc_parent_[i]]);
+        }
+        for (size_t i = 0; i < nodes_.size(); ++i) {
+            move(nodes_[i], root_);
+        }
+        last_propagation_.store(clock::now().time_since_epoch().count(),
+                                std::memory_order_relaxed);
+    }
+
+    static void move(node_type& from, node_type& to) noexcept
+    {
+        // Skip the write to untouched nodes.
+        if (from.load(std::memory_order_relaxed) != 0) {
+            to.fetch_add(from.exchange(0, std::memory_order_relaxed),
+                         std::memory_order_relaxed);
+        }
+    }
+
+    const clock::rep max_staleness_;
+    aligned_atomic<clock::rep, Align> last_propagation_;
+    node_type root_{ 0 };
+    cpu_slots<node_type> leaves_;
+    cpu_slots<node_type> llcs_;
+    cpu_slots<node_type> nodes_;
+    std::vector<size_t> leaf_parent_;
+    std::vector<size_t> llc_parent_;
+    std::mutex mtx_;
+};